@@ -0,0 +1,638 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "cache.h"
+
+#include <string.h>		/* for strdup, strcmp, memcpy, memset */
+#include <errno.h>		/* for ENOENT and friends */
+#include <stdlib.h>		/* for calloc, free */
+#include <time.h>		/* for clock_gettime */
+
+/* --- helper functions --- */
+
+static uint64_t now_ms( void )
+{
+	struct timespec t;
+
+	if( clock_gettime( CLOCK_MONOTONIC, &t ) != 0 ) {
+		return 0;
+	}
+
+	return (uint64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+/* FNV-1a over the name, seeded with the parent id */
+static size_t hash_dentry( const int64_t parent_id, const char *name )
+{
+	uint64_t h = 14695981039346656037ULL ^ (uint64_t)parent_id;
+	const unsigned char *p;
+
+	for( p = (const unsigned char *)name; *p != '\0'; p++ ) {
+		h ^= *p;
+		h *= 1099511628211ULL;
+	}
+
+	return (size_t)( h ^ ( h >> 32 ) );
+}
+
+/* --- dentry cache --- */
+
+int psql_dentry_cache_init( PgDentryCache *cache, const size_t size, const double ttl )
+{
+	size_t i;
+	int res;
+
+	cache->nof_sets = ( size + CACHE_WAYS - 1 ) / CACHE_WAYS;
+	if( cache->nof_sets == 0 ) {
+		cache->nof_sets = 1;
+	}
+	cache->ttl = (uint64_t)( ttl * 1000 );
+
+	cache->entries = (PgDentry *)calloc( cache->nof_sets * CACHE_WAYS, sizeof( PgDentry ) );
+	if( cache->entries == NULL ) {
+		return -ENOMEM;
+	}
+
+	for( i = 0; i < CACHE_LOCK_STRIPES; i++ ) {
+		res = pthread_mutex_init( &cache->locks[i], NULL );
+		if( res != 0 ) {
+			while( i-- > 0 ) {
+				(void)pthread_mutex_destroy( &cache->locks[i] );
+			}
+			free( cache->entries );
+			return -res;
+		}
+	}
+
+	return 0;
+}
+
+int psql_dentry_cache_destroy( PgDentryCache *cache )
+{
+	size_t i;
+
+	psql_dentry_cache_flush( cache );
+
+	for( i = 0; i < CACHE_LOCK_STRIPES; i++ ) {
+		(void)pthread_mutex_destroy( &cache->locks[i] );
+	}
+
+	free( cache->entries );
+
+	return 0;
+}
+
+int psql_dentry_cache_lookup( PgDentryCache *cache, const int64_t parent_id, const char *name, int64_t *id, mode_t *mode )
+{
+	size_t set = hash_dentry( parent_id, name ) % cache->nof_sets;
+	pthread_mutex_t *lock = &cache->locks[set % CACHE_LOCK_STRIPES];
+	PgDentry *e = &cache->entries[set * CACHE_WAYS];
+	uint64_t t = now_ms( );
+	int i;
+
+	(void)pthread_mutex_lock( lock );
+
+	for( i = 0; i < CACHE_WAYS; i++, e++ ) {
+		if( e->name == NULL || e->parent_id != parent_id || strcmp( e->name, name ) != 0 ) {
+			continue;
+		}
+
+		/* stale, free the slot */
+		if( e->expires <= t ) {
+			free( e->name );
+			e->name = NULL;
+			break;
+		}
+
+		*id = e->id;
+		*mode = e->mode;
+		(void)pthread_mutex_unlock( lock );
+		return 1;
+	}
+
+	(void)pthread_mutex_unlock( lock );
+
+	return 0;
+}
+
+void psql_dentry_cache_insert( PgDentryCache *cache, const int64_t parent_id, const char *name, const int64_t id, const mode_t mode )
+{
+	size_t set = hash_dentry( parent_id, name ) % cache->nof_sets;
+	pthread_mutex_t *lock = &cache->locks[set % CACHE_LOCK_STRIPES];
+	PgDentry *e = &cache->entries[set * CACHE_WAYS];
+	PgDentry *victim = NULL;
+	int i;
+
+	if( cache->ttl == 0 ) return;
+
+	(void)pthread_mutex_lock( lock );
+
+	/* take the same entry, a free slot or the one expiring first */
+	for( i = 0; i < CACHE_WAYS; i++, e++ ) {
+		if( e->name != NULL && e->parent_id == parent_id && strcmp( e->name, name ) == 0 ) {
+			victim = e;
+			break;
+		}
+		if( victim == NULL || ( victim->name != NULL &&
+			( e->name == NULL || e->expires < victim->expires ) ) ) {
+			victim = e;
+		}
+	}
+
+	if( victim->name == NULL || strcmp( victim->name, name ) != 0 ) {
+		free( victim->name );
+		victim->name = strdup( name );
+	}
+
+	if( victim->name != NULL ) {
+		victim->parent_id = parent_id;
+		victim->id = id;
+		victim->mode = mode;
+		victim->expires = now_ms( ) + cache->ttl;
+	}
+
+	(void)pthread_mutex_unlock( lock );
+}
+
+void psql_dentry_cache_remove( PgDentryCache *cache, const int64_t parent_id, const char *name )
+{
+	size_t set = hash_dentry( parent_id, name ) % cache->nof_sets;
+	pthread_mutex_t *lock = &cache->locks[set % CACHE_LOCK_STRIPES];
+	PgDentry *e = &cache->entries[set * CACHE_WAYS];
+	int i;
+
+	(void)pthread_mutex_lock( lock );
+
+	for( i = 0; i < CACHE_WAYS; i++, e++ ) {
+		if( e->name != NULL && e->parent_id == parent_id && strcmp( e->name, name ) == 0 ) {
+			free( e->name );
+			e->name = NULL;
+		}
+	}
+
+	(void)pthread_mutex_unlock( lock );
+}
+
+void psql_dentry_cache_flush( PgDentryCache *cache )
+{
+	size_t set;
+	PgDentry *e;
+	int i;
+
+	for( set = 0; set < cache->nof_sets; set++ ) {
+		pthread_mutex_t *lock = &cache->locks[set % CACHE_LOCK_STRIPES];
+
+		(void)pthread_mutex_lock( lock );
+
+		e = &cache->entries[set * CACHE_WAYS];
+		for( i = 0; i < CACHE_WAYS; i++, e++ ) {
+			free( e->name );
+			e->name = NULL;
+		}
+
+		(void)pthread_mutex_unlock( lock );
+	}
+}
+
+/* --- metadata cache --- */
+
+static size_t hash_id( const int64_t id )
+{
+	uint64_t h = (uint64_t)id * 11400714819323198485ULL;
+
+	return (size_t)( h ^ ( h >> 32 ) );
+}
+
+int psql_meta_cache_init( PgMetaCache *cache, const size_t size, const double ttl )
+{
+	size_t i;
+	int res;
+
+	cache->nof_sets = ( size + CACHE_WAYS - 1 ) / CACHE_WAYS;
+	if( cache->nof_sets == 0 ) {
+		cache->nof_sets = 1;
+	}
+	cache->ttl = (uint64_t)( ttl * 1000 );
+
+	cache->entries = (PgMetaEntry *)malloc( cache->nof_sets * CACHE_WAYS * sizeof( PgMetaEntry ) );
+	if( cache->entries == NULL ) {
+		return -ENOMEM;
+	}
+
+	for( i = 0; i < cache->nof_sets * CACHE_WAYS; i++ ) {
+		cache->entries[i].id = -1;
+	}
+
+	for( i = 0; i < CACHE_LOCK_STRIPES; i++ ) {
+		res = pthread_mutex_init( &cache->locks[i], NULL );
+		if( res != 0 ) {
+			while( i-- > 0 ) {
+				(void)pthread_mutex_destroy( &cache->locks[i] );
+			}
+			free( cache->entries );
+			return -res;
+		}
+	}
+
+	return 0;
+}
+
+int psql_meta_cache_destroy( PgMetaCache *cache )
+{
+	size_t i;
+
+	for( i = 0; i < CACHE_LOCK_STRIPES; i++ ) {
+		(void)pthread_mutex_destroy( &cache->locks[i] );
+	}
+
+	free( cache->entries );
+
+	return 0;
+}
+
+int psql_meta_cache_lookup( PgMetaCache *cache, const int64_t id, PgMeta *meta )
+{
+	size_t set = hash_id( id ) % cache->nof_sets;
+	pthread_mutex_t *lock = &cache->locks[set % CACHE_LOCK_STRIPES];
+	PgMetaEntry *e = &cache->entries[set * CACHE_WAYS];
+	int i;
+
+	(void)pthread_mutex_lock( lock );
+
+	for( i = 0; i < CACHE_WAYS; i++, e++ ) {
+		if( e->id != id ) {
+			continue;
+		}
+
+		/* stale, free the slot */
+		if( e->expires <= now_ms( ) ) {
+			e->id = -1;
+			break;
+		}
+
+		*meta = e->meta;
+		(void)pthread_mutex_unlock( lock );
+		return 1;
+	}
+
+	(void)pthread_mutex_unlock( lock );
+
+	return 0;
+}
+
+void psql_meta_cache_insert( PgMetaCache *cache, const int64_t id, const PgMeta *meta )
+{
+	size_t set = hash_id( id ) % cache->nof_sets;
+	pthread_mutex_t *lock = &cache->locks[set % CACHE_LOCK_STRIPES];
+	PgMetaEntry *e = &cache->entries[set * CACHE_WAYS];
+	PgMetaEntry *victim = NULL;
+	int i;
+
+	if( cache->ttl == 0 ) return;
+
+	(void)pthread_mutex_lock( lock );
+
+	/* take the same entry, a free slot or the one expiring first */
+	for( i = 0; i < CACHE_WAYS; i++, e++ ) {
+		if( e->id == id ) {
+			victim = e;
+			break;
+		}
+		if( victim == NULL || ( victim->id != -1 &&
+			( e->id == -1 || e->expires < victim->expires ) ) ) {
+			victim = e;
+		}
+	}
+
+	victim->id = id;
+	victim->meta = *meta;
+	victim->expires = now_ms( ) + cache->ttl;
+
+	(void)pthread_mutex_unlock( lock );
+}
+
+void psql_meta_cache_remove( PgMetaCache *cache, const int64_t id )
+{
+	size_t set = hash_id( id ) % cache->nof_sets;
+	pthread_mutex_t *lock = &cache->locks[set % CACHE_LOCK_STRIPES];
+	PgMetaEntry *e = &cache->entries[set * CACHE_WAYS];
+	int i;
+
+	(void)pthread_mutex_lock( lock );
+
+	for( i = 0; i < CACHE_WAYS; i++, e++ ) {
+		if( e->id == id ) {
+			e->id = -1;
+		}
+	}
+
+	(void)pthread_mutex_unlock( lock );
+}
+
+void psql_meta_cache_flush( PgMetaCache *cache )
+{
+	size_t set;
+	PgMetaEntry *e;
+	int i;
+
+	for( set = 0; set < cache->nof_sets; set++ ) {
+		pthread_mutex_t *lock = &cache->locks[set % CACHE_LOCK_STRIPES];
+
+		(void)pthread_mutex_lock( lock );
+
+		e = &cache->entries[set * CACHE_WAYS];
+		for( i = 0; i < CACHE_WAYS; i++, e++ ) {
+			e->id = -1;
+		}
+
+		(void)pthread_mutex_unlock( lock );
+	}
+}
+
+/* --- data block cache --- */
+
+static size_t hash_block( const int64_t dir_id, const int64_t block_no )
+{
+	return hash_id( dir_id * 1099511628211LL + block_no );
+}
+
+static uint64_t *block_generation( PgBlockCache *cache, const int64_t dir_id )
+{
+	return &cache->generations[(uint64_t)dir_id % CACHE_LOCK_STRIPES];
+}
+
+/* a change of the blocks of 'dir_id', to be called before the change */
+static void bump_generation( PgBlockCache *cache, const int64_t dir_id )
+{
+	(void)__sync_add_and_fetch( block_generation( cache, dir_id ), 1 );
+}
+
+int psql_block_cache_init( PgBlockCache *cache, const size_t size, const size_t block_size, const double ttl )
+{
+	size_t i;
+	int res;
+
+	cache->nof_sets = ( size + CACHE_WAYS - 1 ) / CACHE_WAYS;
+	if( cache->nof_sets == 0 ) {
+		cache->nof_sets = 1;
+	}
+	cache->block_size = block_size;
+	cache->ttl = (uint64_t)( ttl * 1000 );
+
+	cache->entries = (PgBlock *)malloc( cache->nof_sets * CACHE_WAYS * sizeof( PgBlock ) );
+	if( cache->entries == NULL ) {
+		return -ENOMEM;
+	}
+
+	cache->memory = (char *)malloc( cache->nof_sets * CACHE_WAYS * block_size );
+	if( cache->memory == NULL ) {
+		free( cache->entries );
+		return -ENOMEM;
+	}
+
+	for( i = 0; i < cache->nof_sets * CACHE_WAYS; i++ ) {
+		cache->entries[i].dir_id = -1;
+		cache->entries[i].data = cache->memory + i * block_size;
+	}
+
+	for( i = 0; i < CACHE_LOCK_STRIPES; i++ ) {
+		cache->hits[i] = 0;
+		cache->misses[i] = 0;
+		cache->generations[i] = 0;
+		res = pthread_mutex_init( &cache->locks[i], NULL );
+		if( res != 0 ) {
+			while( i-- > 0 ) {
+				(void)pthread_mutex_destroy( &cache->locks[i] );
+			}
+			free( cache->memory );
+			free( cache->entries );
+			return -res;
+		}
+	}
+
+	return 0;
+}
+
+int psql_block_cache_destroy( PgBlockCache *cache )
+{
+	size_t i;
+
+	for( i = 0; i < CACHE_LOCK_STRIPES; i++ ) {
+		(void)pthread_mutex_destroy( &cache->locks[i] );
+	}
+
+	free( cache->memory );
+	free( cache->entries );
+
+	return 0;
+}
+
+int psql_block_cache_lookup( PgBlockCache *cache, const int64_t dir_id, const int64_t block_no, const size_t offset, const size_t len, char *data )
+{
+	size_t set = hash_block( dir_id, block_no ) % cache->nof_sets;
+	size_t stripe = set % CACHE_LOCK_STRIPES;
+	PgBlock *e = &cache->entries[set * CACHE_WAYS];
+	uint64_t t = now_ms( );
+	int i;
+
+	(void)pthread_mutex_lock( &cache->locks[stripe] );
+
+	for( i = 0; i < CACHE_WAYS; i++, e++ ) {
+		if( e->dir_id != dir_id || e->block_no != block_no ) {
+			continue;
+		}
+
+		/* stale, free the slot */
+		if( e->expires <= t ) {
+			e->dir_id = -1;
+			break;
+		}
+
+		memcpy( data, e->data + offset, len );
+		e->used = t;
+		cache->hits[stripe]++;
+		(void)pthread_mutex_unlock( &cache->locks[stripe] );
+		return 1;
+	}
+
+	cache->misses[stripe]++;
+
+	(void)pthread_mutex_unlock( &cache->locks[stripe] );
+
+	return 0;
+}
+
+uint64_t psql_block_cache_generation( PgBlockCache *cache, const int64_t dir_id )
+{
+	return __sync_add_and_fetch( block_generation( cache, dir_id ), 0 );
+}
+
+void psql_block_cache_bump( PgBlockCache *cache )
+{
+	size_t i;
+
+	for( i = 0; i < CACHE_LOCK_STRIPES; i++ ) {
+		(void)__sync_add_and_fetch( &cache->generations[i], 1 );
+	}
+}
+
+/* insert a block, with 'generation' only if the blocks of the file
+ * didn't change since it was taken */
+static void block_insert( PgBlockCache *cache, const int64_t dir_id, const int64_t block_no, const char *data, const size_t len, const uint64_t *generation )
+{
+	size_t set = hash_block( dir_id, block_no ) % cache->nof_sets;
+	pthread_mutex_t *lock = &cache->locks[set % CACHE_LOCK_STRIPES];
+	PgBlock *e = &cache->entries[set * CACHE_WAYS];
+	PgBlock *victim = NULL;
+	uint64_t t = now_ms( );
+	size_t n = ( len < cache->block_size ) ? len : cache->block_size;
+	int i;
+
+	if( cache->ttl == 0 ) return;
+
+	(void)pthread_mutex_lock( lock );
+
+	/* a writer changing this block bumps the generation before it
+	 * takes the lock of the set */
+	if( generation != NULL && psql_block_cache_generation( cache, dir_id ) != *generation ) {
+		(void)pthread_mutex_unlock( lock );
+		return;
+	}
+
+	/* take the same entry, a free slot or the least recently used one */
+	for( i = 0; i < CACHE_WAYS; i++, e++ ) {
+		if( e->dir_id == dir_id && e->block_no == block_no ) {
+			victim = e;
+			break;
+		}
+		if( victim == NULL || ( victim->dir_id != -1 &&
+			( e->dir_id == -1 || e->used < victim->used ) ) ) {
+			victim = e;
+		}
+	}
+
+	victim->dir_id = dir_id;
+	victim->block_no = block_no;
+	memcpy( victim->data, data, n );
+	memset( victim->data + n, 0, cache->block_size - n );
+	victim->used = t;
+	victim->expires = t + cache->ttl;
+
+	(void)pthread_mutex_unlock( lock );
+}
+
+void psql_block_cache_insert( PgBlockCache *cache, const int64_t dir_id, const int64_t block_no, const char *data, const size_t len )
+{
+	bump_generation( cache, dir_id );
+	block_insert( cache, dir_id, block_no, data, len, NULL );
+}
+
+void psql_block_cache_fill( PgBlockCache *cache, const int64_t dir_id, const int64_t block_no, const char *data, const size_t len, const uint64_t generation )
+{
+	block_insert( cache, dir_id, block_no, data, len, &generation );
+}
+
+void psql_block_cache_remove( PgBlockCache *cache, const int64_t dir_id, const int64_t block_no )
+{
+	size_t set = hash_block( dir_id, block_no ) % cache->nof_sets;
+	pthread_mutex_t *lock = &cache->locks[set % CACHE_LOCK_STRIPES];
+	PgBlock *e = &cache->entries[set * CACHE_WAYS];
+	int i;
+
+	bump_generation( cache, dir_id );
+
+	(void)pthread_mutex_lock( lock );
+
+	for( i = 0; i < CACHE_WAYS; i++, e++ ) {
+		if( e->dir_id == dir_id && e->block_no == block_no ) {
+			e->dir_id = -1;
+		}
+	}
+
+	(void)pthread_mutex_unlock( lock );
+}
+
+void psql_block_cache_remove_range( PgBlockCache *cache, const int64_t dir_id, const int64_t from_block_no, const int64_t to_block_no )
+{
+	size_t set;
+	int64_t block_no;
+	PgBlock *e;
+	int i;
+
+	bump_generation( cache, dir_id );
+
+	/* few blocks, look them up one by one */
+	if( to_block_no - from_block_no < (int64_t)cache->nof_sets ) {
+		for( block_no = from_block_no; block_no <= to_block_no; block_no++ ) {
+			psql_block_cache_remove( cache, dir_id, block_no );
+		}
+		return;
+	}
+
+	/* otherwise they are spread over all sets */
+	for( set = 0; set < cache->nof_sets; set++ ) {
+		pthread_mutex_t *lock = &cache->locks[set % CACHE_LOCK_STRIPES];
+
+		(void)pthread_mutex_lock( lock );
+
+		e = &cache->entries[set * CACHE_WAYS];
+		for( i = 0; i < CACHE_WAYS; i++, e++ ) {
+			if( e->dir_id == dir_id && e->block_no >= from_block_no && e->block_no <= to_block_no ) {
+				e->dir_id = -1;
+			}
+		}
+
+		(void)pthread_mutex_unlock( lock );
+	}
+}
+
+void psql_block_cache_flush( PgBlockCache *cache )
+{
+	size_t set;
+	PgBlock *e;
+	int i;
+
+	psql_block_cache_bump( cache );
+
+	for( set = 0; set < cache->nof_sets; set++ ) {
+		pthread_mutex_t *lock = &cache->locks[set % CACHE_LOCK_STRIPES];
+
+		(void)pthread_mutex_lock( lock );
+
+		e = &cache->entries[set * CACHE_WAYS];
+		for( i = 0; i < CACHE_WAYS; i++, e++ ) {
+			e->dir_id = -1;
+		}
+
+		(void)pthread_mutex_unlock( lock );
+	}
+}
+
+void psql_block_cache_stats( PgBlockCache *cache, uint64_t *hits, uint64_t *misses )
+{
+	size_t i;
+
+	*hits = 0;
+	*misses = 0;
+
+	for( i = 0; i < CACHE_LOCK_STRIPES; i++ ) {
+		(void)pthread_mutex_lock( &cache->locks[i] );
+		*hits += cache->hits[i];
+		*misses += cache->misses[i];
+		(void)pthread_mutex_unlock( &cache->locks[i] );
+	}
+}
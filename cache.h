@@ -0,0 +1,143 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <sys/types.h>		/* size_t, mode_t */
+#include <stdint.h>		/* for uint64_t */
+
+#include <pthread.h>		/* for mutex */
+
+#include "pgsql.h"		/* for PgMeta */
+
+/* number of entries per set (entries with the same hash), the oldest one
+ * gets evicted if a set is full */
+#define CACHE_WAYS		4
+
+/* number of mutexes protecting the sets of a cache */
+#define CACHE_LOCK_STRIPES	64
+
+/* --- dentry cache: (parent_id, name) -> (id, mode) --- */
+
+typedef struct PgDentry {
+	int64_t parent_id;	/* id of the directory containing the entry */
+	char *name;		/* name of the entry, NULL for an unused slot */
+	int64_t id;		/* id/inode_no of the entry */
+	mode_t mode;		/* type and permissions of the entry */
+	uint64_t expires;	/* monotonic time in ms when the entry gets stale */
+} PgDentry;
+
+typedef struct PgDentryCache {
+	PgDentry *entries;	/* nof_sets * CACHE_WAYS entries */
+	size_t nof_sets;	/* number of sets */
+	uint64_t ttl;		/* time to live of an entry in ms */
+	pthread_mutex_t locks[CACHE_LOCK_STRIPES]; /* locks protecting the sets */
+} PgDentryCache;
+
+int psql_dentry_cache_init( PgDentryCache *cache, const size_t size, const double ttl );
+
+int psql_dentry_cache_destroy( PgDentryCache *cache );
+
+int psql_dentry_cache_lookup( PgDentryCache *cache, const int64_t parent_id, const char *name, int64_t *id, mode_t *mode );
+
+void psql_dentry_cache_insert( PgDentryCache *cache, const int64_t parent_id, const char *name, const int64_t id, const mode_t mode );
+
+void psql_dentry_cache_remove( PgDentryCache *cache, const int64_t parent_id, const char *name );
+
+void psql_dentry_cache_flush( PgDentryCache *cache );
+
+/* --- metadata (attribute) cache: id -> PgMeta --- */
+
+typedef struct PgMetaEntry {
+	int64_t id;		/* id/inode_no, -1 for an unused slot */
+	PgMeta meta;		/* metadata of the inode */
+	uint64_t expires;	/* monotonic time in ms when the entry gets stale */
+} PgMetaEntry;
+
+typedef struct PgMetaCache {
+	PgMetaEntry *entries;	/* nof_sets * CACHE_WAYS entries */
+	size_t nof_sets;	/* number of sets */
+	uint64_t ttl;		/* time to live of an entry in ms */
+	pthread_mutex_t locks[CACHE_LOCK_STRIPES]; /* locks protecting the sets */
+} PgMetaCache;
+
+int psql_meta_cache_init( PgMetaCache *cache, const size_t size, const double ttl );
+
+int psql_meta_cache_destroy( PgMetaCache *cache );
+
+int psql_meta_cache_lookup( PgMetaCache *cache, const int64_t id, PgMeta *meta );
+
+void psql_meta_cache_insert( PgMetaCache *cache, const int64_t id, const PgMeta *meta );
+
+void psql_meta_cache_remove( PgMetaCache *cache, const int64_t id );
+
+void psql_meta_cache_flush( PgMetaCache *cache );
+
+/* --- data block cache: (dir_id, block_no) -> block data --- */
+
+typedef struct PgBlock {
+	int64_t dir_id;		/* id/inode_no of the file, -1 for an unused slot */
+	int64_t block_no;	/* number of the block in the file */
+	uint64_t used;		/* monotonic time in ms of the last access, the least recently used gets evicted */
+	uint64_t expires;	/* monotonic time in ms when the entry gets stale */
+	char *data;		/* block_size bytes in the memory of the cache */
+} PgBlock;
+
+/* the lock stripes are the shards of the cache, each keeps its own counters */
+typedef struct PgBlockCache {
+	PgBlock *entries;	/* nof_sets * CACHE_WAYS entries */
+	char *memory;		/* data of all entries, allocated once */
+	size_t block_size;	/* size of a data block */
+	size_t nof_sets;	/* number of sets */
+	uint64_t ttl;		/* time to live of an entry in ms */
+	pthread_mutex_t locks[CACHE_LOCK_STRIPES]; /* locks protecting the sets */
+	uint64_t hits[CACHE_LOCK_STRIPES];	/* lookups per shard finding the block */
+	uint64_t misses[CACHE_LOCK_STRIPES];	/* lookups per shard not finding the block */
+	uint64_t generations[CACHE_LOCK_STRIPES]; /* changes of the blocks of the files hashed to a stripe */
+} PgBlockCache;
+
+int psql_block_cache_init( PgBlockCache *cache, const size_t size, const size_t block_size, const double ttl );
+
+int psql_block_cache_destroy( PgBlockCache *cache );
+
+/* copies 'len' bytes of the block starting at 'offset' to 'data' */
+int psql_block_cache_lookup( PgBlockCache *cache, const int64_t dir_id, const int64_t block_no, const size_t offset, const size_t len, char *data );
+
+/* 'len' bytes of 'data', the rest of the block is zero */
+void psql_block_cache_insert( PgBlockCache *cache, const int64_t dir_id, const int64_t block_no, const char *data, const size_t len );
+
+/* taken before reading blocks of a file from the database */
+uint64_t psql_block_cache_generation( PgBlockCache *cache, const int64_t dir_id );
+
+/* like insert for a block read from the database, skipped if the blocks
+ * of the file changed since 'generation' was taken */
+void psql_block_cache_fill( PgBlockCache *cache, const int64_t dir_id, const int64_t block_no, const char *data, const size_t len, const uint64_t generation );
+
+/* changes the generations of all files */
+void psql_block_cache_bump( PgBlockCache *cache );
+
+void psql_block_cache_remove( PgBlockCache *cache, const int64_t dir_id, const int64_t block_no );
+
+/* removes the blocks 'from_block_no' to 'to_block_no' of a file */
+void psql_block_cache_remove_range( PgBlockCache *cache, const int64_t dir_id, const int64_t from_block_no, const int64_t to_block_no );
+
+void psql_block_cache_flush( PgBlockCache *cache );
+
+void psql_block_cache_stats( PgBlockCache *cache, uint64_t *hits, uint64_t *misses );
+
+#endif
@@ -31,9 +31,94 @@
 
 #define MAX_FILENAME_LENGTH	4096
 
-/* maximum number of open database connections */
+/* default number of database connections kept open and maximum number
+ * of connections in the multi-threaded case */
 
-#define MAX_DB_CONNECTIONS	8
+#define DEFAULT_POOL_MIN	2
+#define DEFAULT_POOL_MAX	8
+
+/* seconds between two runs of the pool maintenance and seconds after
+ * which an idle connection above the minimum gets closed */
+
+#define POOL_MAINTENANCE_INTERVAL	5
+#define POOL_IDLE_TIMEOUT	60
+
+/* seconds to wait after a failed connect before the next try, doubled
+ * on every failure up to the maximum */
+
+#define POOL_RETRY_DELAY_MIN	1
+#define POOL_RETRY_DELAY_MAX	60
+
+/* default number of entries in the dentry cache ((parent_id, name) -> id) */
+
+#define DEFAULT_DENTRY_CACHE_SIZE	16384
+
+/* default time in seconds an entry in the dentry cache is considered valid */
+
+#define DEFAULT_DENTRY_CACHE_TTL	1.0
+
+/* default number of entries in the negative cache (names known not to exist) */
+
+#define DEFAULT_NEGATIVE_CACHE_SIZE	4096
+
+/* default time in seconds a name is known not to exist, this is also
+ * passed to the kernel as 'negative_timeout' */
+
+#define DEFAULT_NEGATIVE_CACHE_TTL	1.0
+
+/* default number of entries in the attribute cache (id -> metadata) */
+
+#define DEFAULT_ATTR_CACHE_SIZE		16384
+
+/* default time in seconds cached metadata of an inode is considered valid */
+
+#define DEFAULT_ATTR_CACHE_TTL		1.0
+
+/* default size in bytes of the write-back buffer of an open file */
+
+#define DEFAULT_WRITE_BUFFER_SIZE	262144
+
+/* default time in seconds after which buffered writes are written to
+ * the database by the ager thread */
+
+#define DEFAULT_WRITE_BUFFER_AGE	1.0
+
+/* default maximal size in bytes of the read-ahead window of an open file */
+
+#define DEFAULT_READ_AHEAD_SIZE		1048576
+
+/* default maximal size in bytes of a read or write request of the
+ * kernel (big_writes, max_write, max_read and max_readahead) */
+
+#define DEFAULT_MAX_REQUEST_SIZE	1048576
+
+/* default number of data blocks in the block cache (16 MB with the
+ * default block size) */
+
+#define DEFAULT_BLOCK_CACHE_SIZE	4096
+
+/* default time in seconds a cached data block is considered valid */
+
+#define DEFAULT_BLOCK_CACHE_TTL		1.0
+
+/* default interval in seconds of the background writing of file sizes
+ * and times (0 writes them in the transaction of the change) */
+
+#define DEFAULT_META_FLUSH_INTERVAL	1.0
+
+/* default bytes of WAL a read replica may lag behind the primary and
+ * default seconds between two comparisons of their WAL positions */
+
+#define DEFAULT_REPLICA_MAX_LAG		1048576
+#define DEFAULT_REPLICA_POLL_INTERVAL	0.1
+
+/* seconds after which a read updates the access time with 'relatime' */
+
+#define RELATIME_INTERVAL	86400
+
+/* number of closed file handles kept for reuse */
+
+#define MAX_FREE_FILES		16
 
 /* maximum number of tablespaces, used for free blocks calculation */
 
@@ -0,0 +1,576 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "file.h"
+
+#include <string.h>		/* for memcpy */
+#include <errno.h>		/* for ENOENT and friends */
+#include <stdlib.h>		/* for malloc, free */
+#include <syslog.h>		/* for syslog */
+#include <time.h>		/* for clock_gettime */
+#include <inttypes.h>		/* for PRIi64 */
+#include <stdio.h>		/* for snprintf */
+
+#include "config.h"		/* compiled in defaults */
+#include "pgsql.h"		/* implements Postgresql accessers */
+
+/* --- helper functions --- */
+
+static uint64_t now_ms( void )
+{
+	struct timespec t;
+
+	if( clock_gettime( CLOCK_MONOTONIC, &t ) != 0 ) {
+		return 0;
+	}
+
+	return (uint64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+static void remember_meta( PgFuseData *data, PgFuseFile *f, const PgMeta *meta )
+{
+	f->meta = *meta;
+	f->meta_expires = now_ms( ) + (uint64_t)( data->attr_cache_ttl * 1000 );
+}
+
+/* write a range of the file in one transaction and adapt the file size */
+static int write_range( PgFuseData *data, PgFuseFile *f, const char *path, const char *buf, const size_t size, const off_t offset )
+{
+	int64_t tmp;
+	int res;
+	PgMeta meta;
+	PGconn *conn;
+	
+	ACQUIRE( conn );
+	PSQL_BEGIN( conn );
+	
+	/* not the metadata of the handle, the file may have been changed by
+	 * a path based operation in the meantime */
+	tmp = psql_read_meta( conn, f->id, path, &meta );
+	if( tmp < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return tmp;
+	}
+	
+	if( offset + size > meta.size ) {
+		meta.size = offset + size;
+	}
+	meta.mtime = pgfuse_now( );
+	
+	res = psql_write_buf( conn, data->block_size, f->id, path, buf, offset, size, data->verbose );
+	if( res < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return res;
+	}
+	if( res != size ) {
+		syslog( LOG_ERR, "Write size mismatch in file '%s' on mountpoint '%s', expected '%zu' to be written, but actually wrote '%d' bytes! Data inconistency!",
+			path, data->mountpoint, size, res );
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return -EIO;
+	}
+	
+	res = psql_write_meta_lazy( conn, f->id, path, meta );
+	if( res < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return res;
+	}
+
+	PSQL_COMMIT( conn ); RELEASE( conn );
+	
+	remember_meta( data, f, &meta );
+	
+	return size;
+}
+
+/* relatime: the access time is older than the last change or than a day */
+static int atime_is_old( const PgMeta *meta, const struct timespec now )
+{
+	if( meta->atime.tv_sec < meta->mtime.tv_sec ||
+		( meta->atime.tv_sec == meta->mtime.tv_sec && meta->atime.tv_nsec <= meta->mtime.tv_nsec ) ) {
+		return 1;
+	}
+	
+	if( meta->atime.tv_sec < meta->ctime.tv_sec ||
+		( meta->atime.tv_sec == meta->ctime.tv_sec && meta->atime.tv_nsec <= meta->ctime.tv_nsec ) ) {
+		return 1;
+	}
+	
+	return now.tv_sec - meta->atime.tv_sec >= RELATIME_INTERVAL;
+}
+
+/* set the access time after a read according to the atime policy */
+static int update_atime( PgFuseData *data, PGconn *conn, PgFuseFile *f, const char *path )
+{
+	struct timespec now = pgfuse_now( );
+	int64_t tmp;
+	int res;
+	PgMeta meta;
+	
+	if( data->atime == PGFUSE_NOATIME || data->read_only ) {
+		return 0;
+	}
+	
+	if( data->atime == PGFUSE_RELATIME && !atime_is_old( &f->meta, now ) ) {
+		return 0;
+	}
+	
+	tmp = psql_read_meta( conn, f->id, path, &meta );
+	if( tmp < 0 ) {
+		return tmp;
+	}
+	
+	meta.atime = now;
+	
+	res = psql_write_meta_lazy( conn, f->id, path, meta );
+	if( res < 0 ) {
+		return res;
+	}
+	
+	remember_meta( data, f, &meta );
+	
+	return 0;
+}
+
+/* reads use the file size of the handle, it is refreshed after the
+ * attribute cache TTL */
+static int read_range( PgFuseData *data, PgFuseFile *f, const char *path, char *buf, const size_t size, const off_t offset )
+{
+	int64_t tmp;
+	int res;
+	PgMeta meta;
+	PGconn *conn;
+	
+	/* the standby can serve the read unless the access time has to be
+	 * written in this transaction */
+	if( data->atime == PGFUSE_NOATIME || data->read_only || data->meta_flush_interval > 0 ) {
+		ACQUIRE_READ( conn );
+	} else {
+		ACQUIRE( conn );
+	}
+	PSQL_BEGIN( conn );
+	
+	if( f->meta_expires <= now_ms( ) ) {
+		tmp = psql_read_meta( conn, f->id, path, &meta );
+		if( tmp < 0 ) {
+			PSQL_ROLLBACK( conn ); RELEASE( conn );
+			return tmp;
+		}
+		remember_meta( data, f, &meta );
+	}
+	
+	res = psql_read_data( conn, data->block_size, f->id, path, buf, offset, size, f->meta.size, data->verbose );
+	if( res < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return res;
+	}
+	
+	tmp = update_atime( data, conn, f, path );
+	if( tmp < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return tmp;
+	}
+	
+	PSQL_COMMIT( conn ); RELEASE( conn );
+	
+	return res;
+}
+
+/* write the dirty extent, caller holds the lock of the handle */
+static int flush_locked( PgFuseData *data, PgFuseFile *f, const char *path )
+{
+	int res;
+	
+	if( f->len == 0 ) {
+		return 0;
+	}
+	
+	if( data->verbose ) {
+		syslog( LOG_DEBUG, "Flushing %zu buffered bytes at offset %jd of file '%s'",
+			f->len, f->offset, path );
+	}
+	
+	res = write_range( data, f, path, f->buf, f->len, f->offset );
+	
+	/* the data is lost anyway, report the error once */
+	f->len = 0;
+	
+	return ( res < 0 ) ? res : 0;
+}
+
+/* --- open file handles --- */
+
+/* closed handles are kept for reuse together with their buffers, the
+ * sizes of the buffers are the same for all files of a mount */
+static PgFuseFile *free_files[MAX_FREE_FILES];
+static size_t nof_free_files = 0;
+static pthread_mutex_t free_files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the open handles, walked by the ager */
+static PgFuseFile *open_files = NULL;
+static pthread_mutex_t open_files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+PgFuseFile *pgfuse_file_open( PgFuseData *data, const int64_t id, const PgMeta *meta )
+{
+	PgFuseFile *f = NULL;
+	
+	(void)pthread_mutex_lock( &free_files_lock );
+	if( nof_free_files > 0 ) {
+		f = free_files[--nof_free_files];
+	}
+	(void)pthread_mutex_unlock( &free_files_lock );
+	
+	if( f == NULL ) {
+		f = (PgFuseFile *)malloc( sizeof( PgFuseFile ) );
+		if( f == NULL ) {
+			return NULL;
+		}
+		
+		if( pthread_mutex_init( &f->lock, NULL ) != 0 ) {
+			free( f );
+			return NULL;
+		}
+		
+		f->buf = NULL;
+		f->ra_buf = NULL;
+	}
+	
+	f->id = id;
+	f->meta_expires = 0;
+	if( meta != NULL ) {
+		remember_meta( data, f, meta );
+	}
+	f->offset = 0;
+	f->len = 0;
+	f->dirty_since = 0;
+	f->next_read = 0;
+	f->window = 0;
+	f->ra_end = 0;
+	
+	(void)pthread_mutex_lock( &open_files_lock );
+	f->prev = NULL;
+	f->next = open_files;
+	if( open_files != NULL ) open_files->prev = f;
+	open_files = f;
+	(void)pthread_mutex_unlock( &open_files_lock );
+	
+	return f;
+}
+
+void pgfuse_file_close( PgFuseFile *f )
+{
+	(void)pthread_mutex_lock( &open_files_lock );
+	if( f->prev != NULL ) {
+		f->prev->next = f->next;
+	} else {
+		open_files = f->next;
+	}
+	if( f->next != NULL ) f->next->prev = f->prev;
+	(void)pthread_mutex_unlock( &open_files_lock );
+	
+	/* wait for the ager to finish with the handle */
+	(void)pthread_mutex_lock( &f->lock );
+	(void)pthread_mutex_unlock( &f->lock );
+	
+	(void)pthread_mutex_lock( &free_files_lock );
+	if( nof_free_files < MAX_FREE_FILES ) {
+		free_files[nof_free_files++] = f;
+		f = NULL;
+	}
+	(void)pthread_mutex_unlock( &free_files_lock );
+	
+	if( f != NULL ) {
+		(void)pthread_mutex_destroy( &f->lock );
+		free( f->buf );
+		free( f->ra_buf );
+		free( f );
+	}
+}
+
+void pgfuse_file_free_all( void )
+{
+	PgFuseFile *f;
+	
+	(void)pthread_mutex_lock( &free_files_lock );
+	while( nof_free_files > 0 ) {
+		f = free_files[--nof_free_files];
+		(void)pthread_mutex_destroy( &f->lock );
+		free( f->buf );
+		free( f->ra_buf );
+		free( f );
+	}
+	(void)pthread_mutex_unlock( &free_files_lock );
+}
+
+int pgfuse_file_write( PgFuseData *data, PgFuseFile *f, const char *path, const char *buf, const size_t size, const off_t offset )
+{
+	int res;
+	
+	(void)pthread_mutex_lock( &f->lock );
+	
+	/* big writes gain nothing from buffering */
+	if( size >= data->write_buffer_size ) {
+		res = flush_locked( data, f, path );
+		if( res == 0 ) {
+			res = write_range( data, f, path, buf, size, offset );
+		}
+		(void)pthread_mutex_unlock( &f->lock );
+		return res;
+	}
+	
+	/* the write must overlap or extend the dirty extent and fit into the buffer */
+	if( f->len > 0 && ( offset < f->offset || offset > f->offset + (off_t)f->len ||
+		offset + size > f->offset + data->write_buffer_size ) ) {
+		res = flush_locked( data, f, path );
+		if( res < 0 ) {
+			(void)pthread_mutex_unlock( &f->lock );
+			return res;
+		}
+	}
+	
+	if( f->buf == NULL ) {
+		f->buf = (char *)malloc( data->write_buffer_size );
+		if( f->buf == NULL ) {
+			(void)pthread_mutex_unlock( &f->lock );
+			return -ENOMEM;
+		}
+	}
+	
+	if( f->len == 0 ) {
+		f->offset = offset;
+		f->dirty_since = now_ms( );
+	}
+	
+	memcpy( f->buf + ( offset - f->offset ), buf, size );
+	if( offset + size > f->offset + f->len ) {
+		f->len = offset + size - f->offset;
+	}
+	
+	/* full or too old */
+	res = 0;
+	if( f->len == data->write_buffer_size ||
+		now_ms( ) - f->dirty_since >= (uint64_t)( data->write_buffer_age * 1000 ) ) {
+		res = flush_locked( data, f, path );
+	}
+	
+	(void)pthread_mutex_unlock( &f->lock );
+	
+	return ( res < 0 ) ? res : (int)size;
+}
+
+int pgfuse_file_read( PgFuseData *data, PgFuseFile *f, const char *path, char *buf, const size_t size, const off_t offset )
+{
+	int res;
+	size_t n;
+	off_t start;
+	off_t end;
+	
+	(void)pthread_mutex_lock( &f->lock );
+	
+	/* read our own writes */
+	res = flush_locked( data, f, path );
+	if( res < 0 ) {
+		(void)pthread_mutex_unlock( &f->lock );
+		return res;
+	}
+	
+	/* grow the window on sequential reads, stop reading ahead otherwise */
+	if( offset == f->next_read ) {
+		f->window = ( f->window == 0 ) ? 2 * size : 2 * f->window;
+		if( f->window > data->read_ahead_size ) {
+			f->window = data->read_ahead_size;
+		}
+	} else {
+		f->window = 0;
+	}
+	
+	/* the data read ahead is in the block cache, which keeps it
+	 * coherent with writes and changes of other mounts, a read of data
+	 * already read ahead is a cache hit (or a query if it was dropped) */
+	if( f->window <= size || data->block_cache_size == 0 || offset + (off_t)size <= f->ra_end ) {
+		res = read_range( data, f, path, buf, size, offset );
+		if( res >= 0 ) {
+			f->next_read = offset + res;
+		}
+		(void)pthread_mutex_unlock( &f->lock );
+		return res;
+	}
+	
+	/* whole blocks, partially read ones don't go to the block cache */
+	if( f->ra_buf == NULL ) {
+		f->ra_buf = (char *)malloc( data->read_ahead_size + 2 * data->block_size );
+		if( f->ra_buf == NULL ) {
+			(void)pthread_mutex_unlock( &f->lock );
+			return -ENOMEM;
+		}
+	}
+	start = offset - offset % data->block_size;
+	end = offset + f->window + data->block_size - 1;
+	end -= end % data->block_size;
+	
+	if( data->verbose ) {
+		syslog( LOG_DEBUG, "Reading %jd bytes ahead at offset %jd of file '%s'",
+			(intmax_t)( end - start ), (intmax_t)start, path );
+	}
+	
+	res = read_range( data, f, path, f->ra_buf, end - start, start );
+	if( res < 0 ) {
+		(void)pthread_mutex_unlock( &f->lock );
+		return res;
+	}
+	f->ra_end = start + res;
+	
+	n = ( start + res > offset ) ? start + res - offset : 0;
+	if( n > size ) n = size;
+	memcpy( buf, f->ra_buf + ( offset - start ), n );
+	f->next_read = offset + n;
+	
+	(void)pthread_mutex_unlock( &f->lock );
+	
+	return n;
+}
+
+int pgfuse_file_flush_buffer( PgFuseData *data, PgFuseFile *f, const char *path )
+{
+	int res;
+	
+	(void)pthread_mutex_lock( &f->lock );
+	res = flush_locked( data, f, path );
+	(void)pthread_mutex_unlock( &f->lock );
+	
+	return res;
+}
+
+int pgfuse_file_flush( PgFuseData *data, PgFuseFile *f, const char *path )
+{
+	int res;
+	int tmp;
+	PGconn *conn;
+	
+	(void)pthread_mutex_lock( &f->lock );
+	res = flush_locked( data, f, path );
+	f->meta_expires = 0;
+	(void)pthread_mutex_unlock( &f->lock );
+	
+	/* the size and times of the file must not wait for the flusher */
+	if( psql_has_dirty_meta( f->id ) ) {
+		ACQUIRE( conn );
+		tmp = psql_flush_dirty_meta( conn, f->id );
+		RELEASE( conn );
+		if( res == 0 ) res = tmp;
+	}
+	
+	return res;
+}
+
+/* --- ager writing old buffers of idle handles --- */
+
+static pthread_t ager_thread;
+static pthread_mutex_t ager_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ager_cond = PTHREAD_COND_INITIALIZER;
+static int ager_stop = 0;
+
+/* the list is not locked during the write, which may wait for a
+ * connection held by a thread opening a file, a handle is locked while
+ * it is in the list and close waits for the lock. The walk starts over
+ * after every write, the written handle is clean then. Busy handles are
+ * skipped, their write checks the age itself. */
+static void flush_aged( PgFuseData *data )
+{
+	PgFuseFile *f;
+	char path[32];
+	uint64_t age = (uint64_t)( data->write_buffer_age * 1000 );
+	int res;
+	
+	for( ;; ) {
+		(void)pthread_mutex_lock( &open_files_lock );
+		for( f = open_files; f != NULL; f = f->next ) {
+			if( pthread_mutex_trylock( &f->lock ) != 0 ) continue;
+			if( f->len > 0 && now_ms( ) - f->dirty_since >= age ) break;
+			(void)pthread_mutex_unlock( &f->lock );
+		}
+		(void)pthread_mutex_unlock( &open_files_lock );
+		
+		if( f == NULL ) break;
+		
+		/* only used in messages */
+		snprintf( path, sizeof( path ), "<id %"PRIi64">", f->id );
+		res = flush_locked( data, f, path );
+		if( res < 0 ) {
+			syslog( LOG_ERR, "Writing the aged buffer of file '%s' on mountpoint '%s' failed: %d",
+				path, data->mountpoint, res );
+		}
+		
+		(void)pthread_mutex_unlock( &f->lock );
+	}
+}
+
+static void *ager_main( void *arg )
+{
+	PgFuseData *data = (PgFuseData *)arg;
+	double interval = data->write_buffer_age / 2;
+	struct timespec t;
+	
+	(void)pthread_mutex_lock( &ager_lock );
+	
+	while( !ager_stop ) {
+		(void)clock_gettime( CLOCK_REALTIME, &t );
+		t.tv_sec += (time_t)interval;
+		t.tv_nsec += (long)( ( interval - (time_t)interval ) * 1000000000 );
+		if( t.tv_nsec >= 1000000000 ) {
+			t.tv_sec++;
+			t.tv_nsec -= 1000000000;
+		}
+		
+		(void)pthread_cond_timedwait( &ager_cond, &ager_lock, &t );
+		if( ager_stop ) break;
+		
+		(void)pthread_mutex_unlock( &ager_lock );
+		
+		flush_aged( data );
+		
+		(void)pthread_mutex_lock( &ager_lock );
+	}
+	
+	(void)pthread_mutex_unlock( &ager_lock );
+	
+	return NULL;
+}
+
+int pgfuse_file_ager_start( PgFuseData *data )
+{
+	int res;
+	
+	ager_stop = 0;
+	
+	res = pthread_create( &ager_thread, NULL, ager_main, data );
+	if( res != 0 ) {
+		syslog( LOG_ERR, "Starting the write buffer ager failed: %d", res );
+		return -res;
+	}
+	
+	return 0;
+}
+
+void pgfuse_file_ager_stop( void )
+{
+	(void)pthread_mutex_lock( &ager_lock );
+	ager_stop = 1;
+	(void)pthread_cond_signal( &ager_cond );
+	(void)pthread_mutex_unlock( &ager_lock );
+	
+	(void)pthread_join( ager_thread, NULL );
+}
@@ -0,0 +1,84 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FILE_H
+#define FILE_H
+
+#include <sys/types.h>		/* size_t, off_t */
+#include <stdint.h>		/* for int64_t, uint64_t, uintptr_t */
+
+#include <pthread.h>		/* for mutex */
+
+#include "pgfuse.h"		/* for PgFuseData */
+#include "pgsql.h"		/* for PgMeta */
+
+/* --- open file handle with a write-back buffer --- */
+
+/* small writes are gathered in one contiguous extent per open file,
+ * the extent is written to the database as one multi-block write when
+ * a non-adjacent write arrives, when it is full or too old, and on
+ * flush, fsync and release
+ *
+ * sequential reads fetch a window of data ahead into the block cache,
+ * the window doubles with every sequential read and collapses on a
+ * random read */
+typedef struct PgFuseFile {
+	int64_t id;		/* id/inode_no of the open file */
+	pthread_mutex_t lock;	/* protects the buffers */
+	PgMeta meta;		/* metadata of the file, the size is used by reads */
+	uint64_t meta_expires;	/* monotonic time in ms when 'meta' has to be read again */
+	char *buf;		/* write-back buffer, allocated on the first buffered write */
+	off_t offset;		/* file offset of the first byte in 'buf' */
+	size_t len;		/* number of dirty bytes in 'buf' */
+	uint64_t dirty_since;	/* monotonic time in ms of the first buffered write */
+	off_t next_read;	/* offset where a sequential read continues */
+	size_t window;		/* current read-ahead window in bytes, 0 after a random read */
+	char *ra_buf;		/* scratch buffer of a read ahead, allocated on the first one */
+	off_t ra_end;		/* file offset up to which data was read ahead */
+	struct PgFuseFile *prev;	/* list of the open handles */
+	struct PgFuseFile *next;
+} PgFuseFile;
+
+/* the handle is stored in the 'fh' member of struct fuse_file_info */
+#define PGFUSE_FILE( FI ) ( (PgFuseFile *)(uintptr_t)( FI )->fh )
+
+/* 'meta' is optional, it is read with the first read otherwise */
+PgFuseFile *pgfuse_file_open( PgFuseData *data, const int64_t id, const PgMeta *meta );
+
+void pgfuse_file_close( PgFuseFile *f );
+
+/* releases the handles kept for reuse */
+void pgfuse_file_free_all( void );
+
+int pgfuse_file_write( PgFuseData *data, PgFuseFile *f, const char *path, const char *buf, const size_t size, const off_t offset );
+
+int pgfuse_file_read( PgFuseData *data, PgFuseFile *f, const char *path, char *buf, const size_t size, const off_t offset );
+
+/* writes the buffered data and forgets the data read ahead and the metadata */
+int pgfuse_file_flush( PgFuseData *data, PgFuseFile *f, const char *path );
+
+/* only writes the buffered data, for fstat, the size of the file
+ * includes the lazily written metadata anyway */
+int pgfuse_file_flush_buffer( PgFuseData *data, PgFuseFile *f, const char *path );
+
+/* starts a thread writing the buffers of the open handles older than
+ * 'write_buffer_age', needs the connection pool (multi-threaded mode) */
+int pgfuse_file_ager_start( PgFuseData *data );
+
+void pgfuse_file_ager_stop( void );
+
+#endif
@@ -0,0 +1,131 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "flusher.h"
+#include "pgsql.h"
+
+#include <errno.h>		/* for ENOENT and friends */
+#include <syslog.h>		/* for syslog */
+#include <time.h>		/* for clock_gettime */
+
+static void *flusher_main( void *arg )
+{
+	PgMetaFlusher *flusher = (PgMetaFlusher *)arg;
+	struct timespec t;
+	
+	(void)pthread_mutex_lock( &flusher->lock );
+	
+	while( !flusher->stop ) {
+		(void)clock_gettime( CLOCK_REALTIME, &t );
+		t.tv_sec += (time_t)flusher->interval;
+		t.tv_nsec += (long)( ( flusher->interval - (time_t)flusher->interval ) * 1000000000 );
+		if( t.tv_nsec >= 1000000000 ) {
+			t.tv_sec++;
+			t.tv_nsec -= 1000000000;
+		}
+		
+		(void)pthread_cond_timedwait( &flusher->cond, &flusher->lock, &t );
+		if( flusher->stop ) break;
+		
+		(void)pthread_mutex_unlock( &flusher->lock );
+		
+		if( PQstatus( flusher->conn ) != CONNECTION_OK ) {
+			PQreset( flusher->conn );
+			if( PQstatus( flusher->conn ) == CONNECTION_OK ) {
+				(void)psql_set_client( flusher->conn );
+			}
+		}
+		if( PQstatus( flusher->conn ) == CONNECTION_OK ) {
+			(void)psql_flush_dirty_meta( flusher->conn, -1 );
+		}
+		
+		(void)pthread_mutex_lock( &flusher->lock );
+	}
+	
+	(void)pthread_mutex_unlock( &flusher->lock );
+	
+	return NULL;
+}
+
+int psql_flusher_start( PgMetaFlusher *flusher, const char *conninfo, const double interval )
+{
+	int res;
+	
+	flusher->interval = interval;
+	flusher->stop = 0;
+	
+	flusher->conn = PQconnectdb( conninfo );
+	if( PQstatus( flusher->conn ) != CONNECTION_OK ) {
+		syslog( LOG_ERR, "Connection to database for the metadata flusher failed: %s",
+			PQerrorMessage( flusher->conn ) );
+		PQfinish( flusher->conn );
+		return -EIO;
+	}
+	
+	if( psql_set_client( flusher->conn ) < 0 ) {
+		PQfinish( flusher->conn );
+		return -EIO;
+	}
+	
+	res = pthread_mutex_init( &flusher->lock, NULL );
+	if( res != 0 ) {
+		PQfinish( flusher->conn );
+		return -res;
+	}
+	
+	res = pthread_cond_init( &flusher->cond, NULL );
+	if( res != 0 ) {
+		(void)pthread_mutex_destroy( &flusher->lock );
+		PQfinish( flusher->conn );
+		return -res;
+	}
+	
+	res = pthread_create( &flusher->thread, NULL, flusher_main, flusher );
+	if( res != 0 ) {
+		(void)pthread_cond_destroy( &flusher->cond );
+		(void)pthread_mutex_destroy( &flusher->lock );
+		PQfinish( flusher->conn );
+		return -res;
+	}
+	
+	return 0;
+}
+
+int psql_flusher_stop( PgMetaFlusher *flusher )
+{
+	int res;
+	
+	(void)pthread_mutex_lock( &flusher->lock );
+	flusher->stop = 1;
+	(void)pthread_cond_signal( &flusher->cond );
+	(void)pthread_mutex_unlock( &flusher->lock );
+	
+	(void)pthread_join( flusher->thread, NULL );
+	
+	if( PQstatus( flusher->conn ) != CONNECTION_OK ) {
+		PQreset( flusher->conn );
+		(void)psql_set_client( flusher->conn );
+	}
+	res = psql_flush_dirty_meta( flusher->conn, -1 );
+	
+	PQfinish( flusher->conn );
+	
+	(void)pthread_cond_destroy( &flusher->cond );
+	(void)pthread_mutex_destroy( &flusher->lock );
+	
+	return res;
+}
@@ -0,0 +1,41 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FLUSHER_H
+#define FLUSHER_H
+
+#include <libpq-fe.h>		/* for Postgresql database access */
+
+#include <pthread.h>		/* for threads, mutex and conditionals */
+
+/* thread writing the lazily written metadata of files periodically on
+ * its own connection */
+typedef struct PgMetaFlusher {
+	PGconn *conn;		/* connection of the flusher */
+	double interval;	/* seconds between two flushes */
+	pthread_t thread;	/* the flusher thread */
+	pthread_mutex_t lock;	/* monitor lock */
+	pthread_cond_t cond;	/* condition signalling the stop */
+	int stop;		/* the thread should terminate */
+} PgMetaFlusher;
+
+int psql_flusher_start( PgMetaFlusher *flusher, const char *conninfo, const double interval );
+
+/* stops the thread and writes what is left */
+int psql_flusher_stop( PgMetaFlusher *flusher );
+
+#endif
@@ -0,0 +1,170 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "listener.h"
+#include "pgfuse.h"
+#include "pgsql.h"
+
+#include <string.h>		/* for strcmp */
+#include <errno.h>		/* for ENOENT and friends */
+#include <syslog.h>		/* for syslog */
+#include <stdio.h>		/* for sscanf */
+#include <inttypes.h>		/* for SCNd64 */
+#include <sys/select.h>		/* for select */
+#include <unistd.h>		/* for sleep */
+
+/* seconds the listener waits at most before looking at 'stop' */
+#define LISTENER_POLL_INTERVAL	1
+
+/* 'stop' is set by another thread, always accessed atomically */
+static int is_stopped( PgListener *listener )
+{
+	return __sync_add_and_fetch( &listener->stop, 0 ) != 0;
+}
+
+static int listen_conn( PGconn *conn )
+{
+	PGresult *res;
+	
+	res = PQexec( conn, "LISTEN pgfuse" );
+	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
+		syslog( LOG_ERR, "Listening for changes failed: %s", PQerrorMessage( conn ) );
+		PQclear( res );
+		return -EIO;
+	}
+	
+	PQclear( res );
+	
+	return 0;
+}
+
+static void handle_notify( PgListener *listener, const char *payload )
+{
+	char client[64];
+	int64_t id;
+	int64_t parent_id;
+	int n = 0;
+	const char *name;
+	
+	if( sscanf( payload, "d %63s %"SCNd64" %"SCNd64"%n", client, &id, &parent_id, &n ) == 3 && n > 0 ) {
+		if( strcmp( client, psql_client_id( ) ) == 0 ) return;
+		name = ( payload[n] == ' ' ) ? payload + n + 1 : "";
+		
+		psql_invalidate_dir( id, parent_id, name );
+		pgfuse_invalidate_inode( listener->data, id );
+		if( *name != '\0' ) {
+			pgfuse_invalidate_entry( listener->data, parent_id, name );
+		}
+	} else if( sscanf( payload, "b %63s %"SCNd64, client, &id ) == 2 ) {
+		if( strcmp( client, psql_client_id( ) ) == 0 ) return;
+		
+		psql_invalidate_data( id );
+		pgfuse_invalidate_inode( listener->data, id );
+	} else {
+		syslog( LOG_WARNING, "Ignoring unknown change notification '%s'", payload );
+	}
+}
+
+static void *listener_main( void *arg )
+{
+	PgListener *listener = (PgListener *)arg;
+	PGnotify *notify;
+	fd_set fds;
+	struct timeval t;
+	int sock;
+	int delay = 1;
+	int i;
+	
+	while( !is_stopped( listener ) ) {
+		/* we missed changes while the connection was down */
+		if( PQstatus( listener->conn ) != CONNECTION_OK ) {
+			PQreset( listener->conn );
+			if( PQstatus( listener->conn ) != CONNECTION_OK || listen_conn( listener->conn ) < 0 ) {
+				for( i = 0; i < delay && !is_stopped( listener ); i++ ) {
+					sleep( LISTENER_POLL_INTERVAL );
+				}
+				if( delay < 32 ) delay *= 2;
+				continue;
+			}
+			delay = 1;
+			psql_invalidate_all( );
+		}
+		
+		sock = PQsocket( listener->conn );
+		FD_ZERO( &fds );
+		FD_SET( sock, &fds );
+		t.tv_sec = LISTENER_POLL_INTERVAL;
+		t.tv_usec = 0;
+		if( select( sock + 1, &fds, NULL, NULL, &t ) < 0 ) {
+			if( errno == EINTR ) continue;
+			syslog( LOG_ERR, "Waiting for change notifications failed: %d", errno );
+			break;
+		}
+		
+		if( !PQconsumeInput( listener->conn ) ) {
+			syslog( LOG_ERR, "Receiving change notifications failed: %s", PQerrorMessage( listener->conn ) );
+			continue;
+		}
+		
+		while( ( notify = PQnotifies( listener->conn ) ) != NULL ) {
+			handle_notify( listener, notify->extra );
+			PQfreemem( notify );
+		}
+	}
+	
+	return NULL;
+}
+
+int psql_listener_start( PgListener *listener, struct PgFuseData *data, const char *conninfo )
+{
+	int res;
+	
+	listener->data = data;
+	listener->stop = 0;
+	
+	listener->conn = PQconnectdb( conninfo );
+	if( PQstatus( listener->conn ) != CONNECTION_OK ) {
+		syslog( LOG_ERR, "Connection to database for the change listener failed: %s",
+			PQerrorMessage( listener->conn ) );
+		PQfinish( listener->conn );
+		return -EIO;
+	}
+	
+	if( listen_conn( listener->conn ) < 0 ) {
+		PQfinish( listener->conn );
+		return -EIO;
+	}
+	
+	res = pthread_create( &listener->thread, NULL, listener_main, listener );
+	if( res != 0 ) {
+		PQfinish( listener->conn );
+		return -res;
+	}
+	
+	return 0;
+}
+
+int psql_listener_stop( PgListener *listener )
+{
+	(void)__sync_add_and_fetch( &listener->stop, 1 );
+	
+	(void)pthread_join( listener->thread, NULL );
+	
+	PQfinish( listener->conn );
+	
+	return 0;
+}
@@ -0,0 +1,40 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <libpq-fe.h>		/* for Postgresql database access */
+
+#include <pthread.h>		/* for threads */
+
+struct PgFuseData;
+
+/* thread receiving the change notifications of other mounts on its
+ * own connection and invalidating the local and kernel caches */
+typedef struct PgListener {
+	struct PgFuseData *data; /* the mount, for the kernel invalidations */
+	PGconn *conn;		/* connection listening on channel 'pgfuse' */
+	pthread_t thread;	/* the listener thread */
+	int stop;		/* the thread should terminate, accessed atomically */
+} PgListener;
+
+int psql_listener_start( PgListener *listener, struct PgFuseData *data, const char *conninfo );
+
+int psql_listener_stop( PgListener *listener );
+
+#endif
@@ -0,0 +1,1274 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>		/* for strlen, memset */
+#include <stdlib.h>		/* for malloc, realloc, free */
+#include <stdio.h>		/* for fprintf, snprintf */
+#include <syslog.h>		/* for syslog */
+#include <errno.h>		/* for ENOENT and friends */
+#include <sys/types.h>		/* size_t */
+#include <sys/stat.h>		/* mode_t */
+#include <stdint.h>		/* for uint64_t */
+#include <inttypes.h>		/* for PRIxxx macros */
+
+#include <fuse_lowlevel.h>	/* for the inode based FUSE API */
+
+#include "pgsql.h"		/* implements Postgresql accessers */
+#include "pgfuse.h"		/* shared data of the FUSE frontends */
+#include "file.h"		/* open file handles with write-back buffer */
+
+#if FUSE_VERSION >= 27
+
+/* The kernel reserves inode 1 for the root (FUSE_ROOT_ID), in the
+ * database the root has id 0 and all other ids come from BIGSERIAL
+ * starting at 1, so the mapping is a simple shift by one.
+ */
+#define INO_TO_ID( I ) ( (int64_t)( I ) - 1 )
+#define ID_TO_INO( I ) ( (fuse_ino_t)( ( I ) + 1 ) )
+
+/* the psql_* functions want a path for their error messages */
+static const char *inode_path( char *buf, size_t size, const int64_t id )
+{
+	snprintf( buf, size, "<inode %"PRIi64">", id );
+
+	return buf;
+}
+
+static void meta_to_stat( PgFuseData *data, const int64_t id, const PgMeta *meta, struct stat *stbuf )
+{
+	memset( stbuf, 0, sizeof( struct stat ) );
+
+	stbuf->st_ino = ID_TO_INO( id );
+	stbuf->st_mode = meta->mode;
+	stbuf->st_size = meta->size;
+	stbuf->st_blksize = data->block_size;
+	stbuf->st_blocks = ( meta->size + data->block_size - 1 ) / data->block_size;
+	/* TODO: set correctly from table */
+	stbuf->st_nlink = 1;
+	stbuf->st_uid = meta->uid;
+	stbuf->st_gid = meta->gid;
+	stbuf->st_atime = meta->atime.tv_sec;
+	stbuf->st_mtime = meta->mtime.tv_sec;
+	stbuf->st_ctime = meta->ctime.tv_sec;
+}
+
+static void meta_to_entry( PgFuseData *data, const int64_t id, const PgMeta *meta, struct fuse_entry_param *e )
+{
+	memset( e, 0, sizeof( struct fuse_entry_param ) );
+
+	e->ino = ID_TO_INO( id );
+	e->attr_timeout = data->kernel_attr_ttl;
+	e->entry_timeout = data->kernel_entry_ttl;
+	meta_to_stat( data, id, meta, &e->attr );
+}
+
+/* --- directory listings, read completely in opendir --- */
+
+typedef struct PgDirBuf {
+	fuse_req_t req;		/* request of opendir, needed to encode entries */
+	char *p;		/* encoded directory entries */
+	size_t size;		/* size of the encoded entries */
+	int error;		/* -ENOMEM if an entry couldn't be added */
+} PgDirBuf;
+
+static int dirbuf_add( void *buf, const char *name, const struct stat *stbuf, off_t off )
+{
+	PgDirBuf *b = (PgDirBuf *)buf;
+	struct stat st;
+	size_t len;
+	char *p;
+
+	memset( &st, 0, sizeof( st ) );
+	if( stbuf != NULL ) {
+		st.st_ino = ID_TO_INO( stbuf->st_ino );
+		st.st_mode = stbuf->st_mode;
+	}
+
+	len = fuse_add_direntry( b->req, NULL, 0, name, NULL, 0 );
+	p = (char *)realloc( b->p, b->size + len );
+	if( p == NULL ) {
+		b->error = -ENOMEM;
+		return 1;
+	}
+	b->p = p;
+
+	fuse_add_direntry( b->req, b->p + b->size, len, name, &st, b->size + len );
+	b->size += len;
+
+	return 0;
+}
+
+static void dirbuf_free( PgDirBuf *b )
+{
+	free( b->p );
+	free( b );
+}
+
+/* --- implementation of the operations, the FUSE hooks below reply --- */
+
+static int ll_lookup( PgFuseData *data, fuse_ino_t parent, const char *name, struct fuse_entry_param *e )
+{
+	int64_t id;
+	PgMeta meta;
+	PGconn *conn;
+
+	if( data->verbose ) {
+		syslog( LOG_INFO, "Lookup '%s' in inode %lu on '%s', thread #%u",
+			name, parent, data->mountpoint, THREAD_ID );
+	}
+
+	ACQUIRE_READ( conn );
+	PSQL_BEGIN( conn );
+
+	id = psql_lookup( conn, INO_TO_ID( parent ), name, &meta );
+	if( id < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return id;
+	}
+
+	meta_to_entry( data, id, &meta, e );
+
+	PSQL_COMMIT( conn ); RELEASE( conn );
+
+	return 0;
+}
+
+static int ll_getattr( PgFuseData *data, fuse_ino_t ino, struct stat *stbuf )
+{
+	int64_t id;
+	PgMeta meta;
+	PGconn *conn;
+	char path[32];
+
+	if( data->verbose ) {
+		syslog( LOG_INFO, "GetAttrs of inode %lu on '%s', thread #%u",
+			ino, data->mountpoint, THREAD_ID );
+	}
+
+	ACQUIRE_READ( conn );
+	PSQL_BEGIN( conn );
+
+	id = psql_read_meta( conn, INO_TO_ID( ino ), inode_path( path, sizeof( path ), INO_TO_ID( ino ) ), &meta );
+	if( id < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return id;
+	}
+
+	meta_to_stat( data, id, &meta, stbuf );
+
+	PSQL_COMMIT( conn ); RELEASE( conn );
+
+	return 0;
+}
+
+static int ll_setattr( PgFuseData *data, fuse_ino_t ino, struct stat *attr, int to_set, struct stat *stbuf )
+{
+	int64_t id;
+	PgMeta meta;
+	int res;
+	PGconn *conn;
+	char path[32];
+
+	if( data->verbose ) {
+		syslog( LOG_INFO, "SetAttrs (%x) of inode %lu on '%s', thread #%u",
+			(unsigned int)to_set, ino, data->mountpoint, THREAD_ID );
+	}
+
+	ACQUIRE( conn );
+	PSQL_BEGIN( conn );
+
+	inode_path( path, sizeof( path ), INO_TO_ID( ino ) );
+
+	id = psql_read_meta( conn, INO_TO_ID( ino ), path, &meta );
+	if( id < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return id;
+	}
+
+	if( data->read_only ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return -EROFS;
+	}
+
+	if( to_set & FUSE_SET_ATTR_MODE ) {
+		meta.mode = attr->st_mode;
+	}
+	if( to_set & FUSE_SET_ATTR_UID ) {
+		meta.uid = attr->st_uid;
+	}
+	if( to_set & FUSE_SET_ATTR_GID ) {
+		meta.gid = attr->st_gid;
+	}
+	if( to_set & FUSE_SET_ATTR_SIZE ) {
+		if( S_ISDIR( meta.mode ) ) {
+			PSQL_ROLLBACK( conn ); RELEASE( conn );
+			return -EISDIR;
+		}
+
+		res = psql_truncate( conn, data->block_size, id, path, attr->st_size );
+		if( res < 0 ) {
+			PSQL_ROLLBACK( conn ); RELEASE( conn );
+			return res;
+		}
+		meta.size = attr->st_size;
+	}
+	if( to_set & FUSE_SET_ATTR_ATIME ) {
+		meta.atime = attr->st_atim;
+	}
+	if( to_set & FUSE_SET_ATTR_MTIME ) {
+		meta.mtime = attr->st_mtim;
+	}
+#ifdef FUSE_SET_ATTR_ATIME_NOW
+	if( to_set & FUSE_SET_ATTR_ATIME_NOW ) {
+		meta.atime = pgfuse_now( );
+	}
+	if( to_set & FUSE_SET_ATTR_MTIME_NOW ) {
+		meta.mtime = pgfuse_now( );
+	}
+#endif
+
+	res = psql_write_meta( conn, id, path, meta );
+	if( res < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return res;
+	}
+
+	meta_to_stat( data, id, &meta, stbuf );
+
+	PSQL_COMMIT( conn ); RELEASE( conn );
+
+	return 0;
+}
+
+/* create a file, directory or symlink (with target 'link') */
+static int ll_mknode( PgFuseData *data, const struct fuse_ctx *ctx, fuse_ino_t parent, const char *name, mode_t mode, const char *link, struct fuse_entry_param *e )
+{
+	int64_t parent_id;
+	int64_t id;
+	PgMeta meta;
+	int res;
+	PGconn *conn;
+	char path[32];
+
+	if( data->verbose ) {
+		syslog( LOG_INFO, "Create '%s' in inode %lu in mode '%o' on '%s', thread #%u",
+			name, parent, (unsigned int)mode, data->mountpoint, THREAD_ID );
+	}
+
+	ACQUIRE( conn );
+	PSQL_BEGIN( conn );
+
+	if( data->read_only ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return -EROFS;
+	}
+
+	parent_id = psql_read_meta( conn, INO_TO_ID( parent ), inode_path( path, sizeof( path ), INO_TO_ID( parent ) ), &meta );
+	if( parent_id < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return parent_id;
+	}
+	if( !S_ISDIR( meta.mode ) ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return -ENOTDIR;
+	}
+
+	id = psql_lookup( conn, parent_id, name, &meta );
+	if( id < 0 && id != -ENOENT ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return id;
+	}
+	if( id >= 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return -EEXIST;
+	}
+
+	meta.size = ( link != NULL ) ? strlen( link ) : 0;
+	meta.mode = mode;
+	meta.uid = ctx->uid;
+	meta.gid = ctx->gid;
+	meta.ctime = pgfuse_now( );
+	meta.mtime = meta.ctime;
+	meta.atime = meta.ctime;
+
+	if( S_ISDIR( mode ) ) {
+		res = psql_create_dir( conn, parent_id, name, name, meta );
+	} else {
+		res = psql_create_file( conn, parent_id, name, name, meta );
+	}
+	if( res < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return res;
+	}
+
+	id = psql_lookup( conn, parent_id, name, &meta );
+	if( id < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return id;
+	}
+
+	if( link != NULL ) {
+		res = psql_write_buf( conn, data->block_size, id, name, link, 0, strlen( link ), data->verbose );
+		if( res < 0 ) {
+			PSQL_ROLLBACK( conn ); RELEASE( conn );
+			return res;
+		}
+		if( res != strlen( link ) ) {
+			PSQL_ROLLBACK( conn ); RELEASE( conn );
+			return -EIO;
+		}
+	}
+
+	meta_to_entry( data, id, &meta, e );
+
+	PSQL_COMMIT( conn ); RELEASE( conn );
+
+	return 0;
+}
+
+static int ll_remove( PgFuseData *data, fuse_ino_t parent, const char *name, int is_dir )
+{
+	int64_t id;
+	PgMeta meta;
+	int res;
+	PGconn *conn;
+
+	if( data->verbose ) {
+		syslog( LOG_INFO, "Remove %s '%s' in inode %lu on '%s', thread #%u",
+			is_dir ? "dir" : "file", name, parent, data->mountpoint, THREAD_ID );
+	}
+
+	ACQUIRE( conn );
+	PSQL_BEGIN( conn );
+
+	id = psql_lookup( conn, INO_TO_ID( parent ), name, &meta );
+	if( id < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return id;
+	}
+	if( is_dir && !S_ISDIR( meta.mode ) ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return -ENOTDIR;
+	}
+	if( !is_dir && S_ISDIR( meta.mode ) ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return -EPERM;
+	}
+
+	if( data->read_only ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return -EROFS;
+	}
+
+	if( is_dir ) {
+		res = psql_delete_dir( conn, id, name );
+	} else {
+		res = psql_delete_file( conn, id, name );
+	}
+	if( res < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return res;
+	}
+
+	PSQL_COMMIT( conn ); RELEASE( conn );
+
+	return 0;
+}
+
+static int ll_rename( PgFuseData *data, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname )
+{
+	int64_t from_id;
+	int64_t to_id;
+	int64_t to_parent_id;
+	PgMeta from_meta;
+	PgMeta to_meta;
+	int res;
+	PGconn *conn;
+	char path[32];
+
+	if( data->verbose ) {
+		syslog( LOG_INFO, "Renaming '%s' in inode %lu to '%s' in inode %lu on '%s', thread #%u",
+			name, parent, newname, newparent, data->mountpoint, THREAD_ID );
+	}
+
+	ACQUIRE( conn );
+	PSQL_BEGIN( conn );
+
+	from_id = psql_lookup( conn, INO_TO_ID( parent ), name, &from_meta );
+	if( from_id < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return from_id;
+	}
+
+	to_id = psql_lookup( conn, INO_TO_ID( newparent ), newname, &to_meta );
+	if( to_id < 0 && to_id != -ENOENT ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return to_id;
+	}
+
+	/* destination already exists */
+	if( to_id >= 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		/* source equal to destination? This should succeed */
+		if( S_ISREG( to_meta.mode ) ) {
+			return ( to_id == from_id ) ? 0 : -EEXIST;
+		}
+		/* TODO: handle all other cases */
+		return -EINVAL;
+	}
+
+	to_parent_id = psql_read_meta( conn, INO_TO_ID( newparent ), inode_path( path, sizeof( path ), INO_TO_ID( newparent ) ), &to_meta );
+	if( to_parent_id < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return to_parent_id;
+	}
+
+	if( data->read_only ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return -EROFS;
+	}
+
+	res = psql_rename( conn, from_id, from_meta.parent_id, to_parent_id, newname, name, newname );
+	if( res < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return res;
+	}
+
+	PSQL_COMMIT( conn ); RELEASE( conn );
+
+	return 0;
+}
+
+static int ll_readlink( PgFuseData *data, fuse_ino_t ino, char **link )
+{
+	int64_t id;
+	PgMeta meta;
+	int res;
+	PGconn *conn;
+	char path[32];
+
+	if( data->verbose ) {
+		syslog( LOG_INFO, "Dereferencing symlink inode %lu on '%s', thread #%u",
+			ino, data->mountpoint, THREAD_ID );
+	}
+
+	ACQUIRE_READ( conn );
+	PSQL_BEGIN( conn );
+
+	inode_path( path, sizeof( path ), INO_TO_ID( ino ) );
+
+	id = psql_read_meta( conn, INO_TO_ID( ino ), path, &meta );
+	if( id < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return id;
+	}
+	if( !S_ISLNK( meta.mode ) ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return -EINVAL;
+	}
+
+	*link = (char *)malloc( meta.size + 1 );
+	if( *link == NULL ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return -ENOMEM;
+	}
+
+	res = psql_read_buf( conn, data->block_size, id, path, *link, 0, meta.size, data->verbose );
+	if( res < 0 ) {
+		free( *link );
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return res;
+	}
+
+	(*link)[meta.size] = '\0';
+
+	PSQL_COMMIT( conn ); RELEASE( conn );
+
+	return 0;
+}
+
+/* --- page cache of the kernel --- */
+
+/* size and mtime of files at their last open, with 'auto_cache' the
+ * kernel keeps the cached pages if they didn't change */
+typedef struct PgOpenStamp {
+	int64_t id;		/* id/inode_no, -1 for an unused slot */
+	off_t size;		/* size at the last open */
+	struct timespec mtime;	/* modification time at the last open */
+} PgOpenStamp;
+
+#define OPEN_STAMPS	1024
+
+static PgOpenStamp open_stamps[OPEN_STAMPS];
+static pthread_mutex_t open_stamps_lock = PTHREAD_MUTEX_INITIALIZER;
+static int open_stamps_init = 0;
+
+static int keep_cache( PgFuseData *data, const int64_t id, const PgMeta *meta )
+{
+	PgOpenStamp *s;
+	int keep;
+	size_t i;
+	
+	if( data->kernel_cache ) {
+		return 1;
+	}
+	
+	if( !data->auto_cache ) {
+		return 0;
+	}
+	
+	(void)pthread_mutex_lock( &open_stamps_lock );
+	if( !open_stamps_init ) {
+		for( i = 0; i < OPEN_STAMPS; i++ ) {
+			open_stamps[i].id = -1;
+		}
+		open_stamps_init = 1;
+	}
+	
+	s = &open_stamps[(uint64_t)id % OPEN_STAMPS];
+	keep = ( s->id == id && s->size == meta->size &&
+		s->mtime.tv_sec == meta->mtime.tv_sec && s->mtime.tv_nsec == meta->mtime.tv_nsec );
+	s->id = id;
+	s->size = meta->size;
+	s->mtime = meta->mtime;
+	(void)pthread_mutex_unlock( &open_stamps_lock );
+	
+	return keep;
+}
+
+static int ll_open( PgFuseData *data, fuse_ino_t ino, struct fuse_file_info *fi )
+{
+	int64_t id;
+	PgMeta meta;
+	PGconn *conn;
+	char path[32];
+
+	if( data->verbose ) {
+		syslog( LOG_INFO, "Open inode %lu on '%s' with flags '%x', thread #%u",
+			ino, data->mountpoint, (unsigned int)fi->flags, THREAD_ID );
+	}
+
+	ACQUIRE( conn );
+	PSQL_BEGIN( conn );
+
+	id = psql_read_meta( conn, INO_TO_ID( ino ), inode_path( path, sizeof( path ), INO_TO_ID( ino ) ), &meta );
+	if( id < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return id;
+	}
+
+	if( S_ISDIR( meta.mode ) ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return -EISDIR;
+	}
+
+	if( data->read_only && ( fi->flags & O_ACCMODE ) != O_RDONLY ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return -EROFS;
+	}
+
+	fi->fh = (uintptr_t)pgfuse_file_open( data, id, &meta );
+	if( fi->fh == 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return -ENOMEM;
+	}
+	
+	fi->keep_cache = keep_cache( data, id, &meta );
+
+	PSQL_COMMIT( conn ); RELEASE( conn );
+
+	return 0;
+}
+
+/* write the buffered data of an open file */
+static int ll_flush( PgFuseData *data, struct fuse_file_info *fi )
+{
+	char path[32];
+
+	return pgfuse_file_flush( data, PGFUSE_FILE( fi ), inode_path( path, sizeof( path ), PGFUSE_FILE( fi )->id ) );
+}
+
+static int ll_read( PgFuseData *data, fuse_ino_t ino, char *buf, size_t size, off_t off, struct fuse_file_info *fi )
+{
+	char path[32];
+
+	if( data->verbose ) {
+		syslog( LOG_INFO, "Read to inode %lu from offset %jd, size %zu on '%s', thread #%u",
+			ino, off, size, data->mountpoint, THREAD_ID );
+	}
+
+	return pgfuse_file_read( data, PGFUSE_FILE( fi ), inode_path( path, sizeof( path ), PGFUSE_FILE( fi )->id ), buf, size, off );
+}
+
+static int ll_write( PgFuseData *data, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi )
+{
+	char path[32];
+
+	if( data->verbose ) {
+		syslog( LOG_INFO, "Write to inode %lu from offset %jd, size %zu on '%s', thread #%u",
+			ino, off, size, data->mountpoint, THREAD_ID );
+	}
+
+	if( data->read_only ) {
+		return -EBADF;
+	}
+
+	return pgfuse_file_write( data, PGFUSE_FILE( fi ), inode_path( path, sizeof( path ), PGFUSE_FILE( fi )->id ), buf, size, off );
+}
+
+static int ll_opendir( PgFuseData *data, fuse_req_t req, fuse_ino_t ino, PgDirBuf **dirbuf )
+{
+	int64_t id;
+	PgMeta meta;
+	PgDirBuf *b;
+	int res;
+	PGconn *conn;
+	char path[32];
+
+	if( data->verbose ) {
+		syslog( LOG_INFO, "Opendir inode %lu on '%s', thread #%u",
+			ino, data->mountpoint, THREAD_ID );
+	}
+
+	ACQUIRE_READ( conn );
+	PSQL_BEGIN( conn );
+
+	id = psql_read_meta( conn, INO_TO_ID( ino ), inode_path( path, sizeof( path ), INO_TO_ID( ino ) ), &meta );
+	if( id < 0 ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return id;
+	}
+	if( !S_ISDIR( meta.mode ) ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return -ENOTDIR;
+	}
+
+	b = (PgDirBuf *)calloc( 1, sizeof( PgDirBuf ) );
+	if( b == NULL ) {
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return -ENOMEM;
+	}
+	b->req = req;
+
+	/* filler takes database ids, not inode numbers */
+	{
+		struct stat st;
+
+		memset( &st, 0, sizeof( st ) );
+		st.st_mode = S_IFDIR;
+		st.st_ino = id;
+		dirbuf_add( b, ".", &st, 0 );
+		st.st_ino = meta.parent_id;
+		dirbuf_add( b, "..", &st, 0 );
+	}
+
+	res = psql_readdir( conn, id, b, dirbuf_add );
+	if( res == 0 ) {
+		res = b->error;
+	}
+	if( res < 0 ) {
+		dirbuf_free( b );
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return res;
+	}
+
+	*dirbuf = b;
+
+	PSQL_COMMIT( conn ); RELEASE( conn );
+
+	return 0;
+}
+
+/* --- FUSE low-level hooks --- */
+
+static void pgfuse_ll_init( void *userdata, struct fuse_conn_info *conn )
+{
+	PgFuseData *data = (PgFuseData *)userdata;
+	
+	if( data->verbose ) {
+		syslog( LOG_INFO, "Kernel requests on '%s' up to %u bytes written, %u bytes read ahead",
+			data->mountpoint, conn->max_write, conn->max_readahead );
+	}
+	
+	pgfuse_setup( data );
+}
+
+static void pgfuse_ll_destroy( void *userdata )
+{
+	pgfuse_teardown( (PgFuseData *)userdata );
+}
+
+static void pgfuse_ll_lookup( fuse_req_t req, fuse_ino_t parent, const char *name )
+{
+	PgFuseData *data = (PgFuseData *)fuse_req_userdata( req );
+	struct fuse_entry_param e;
+	int res;
+
+	res = ll_lookup( data, parent, name, &e );
+
+	/* a zero inode lets the kernel cache the non-existing name */
+	if( res == -ENOENT && data->negative_cache_size > 0 ) {
+		memset( &e, 0, sizeof( e ) );
+		e.entry_timeout = data->negative_cache_ttl;
+		fuse_reply_entry( req, &e );
+		return;
+	}
+
+	if( res < 0 ) {
+		fuse_reply_err( req, -res );
+		return;
+	}
+
+	fuse_reply_entry( req, &e );
+}
+
+static void pgfuse_ll_forget( fuse_req_t req, fuse_ino_t ino, unsigned long nlookup )
+{
+	/* nothing to do, inode numbers are the persistent ids in the database */
+	fuse_reply_none( req );
+}
+
+static void pgfuse_ll_getattr( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi )
+{
+	PgFuseData *data = (PgFuseData *)fuse_req_userdata( req );
+	struct stat stbuf;
+	int res;
+
+	/* fstat, the size must include the buffered writes */
+	if( fi != NULL ) {
+		char path[32];
+		
+		res = pgfuse_file_flush_buffer( data, PGFUSE_FILE( fi ), inode_path( path, sizeof( path ), PGFUSE_FILE( fi )->id ) );
+		if( res < 0 ) {
+			fuse_reply_err( req, -res );
+			return;
+		}
+	}
+
+	res = ll_getattr( data, ino, &stbuf );
+	if( res < 0 ) {
+		fuse_reply_err( req, -res );
+		return;
+	}
+
+	fuse_reply_attr( req, &stbuf, data->kernel_attr_ttl );
+}
+
+static void pgfuse_ll_setattr( fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi )
+{
+	PgFuseData *data = (PgFuseData *)fuse_req_userdata( req );
+	struct stat stbuf;
+	int res;
+
+	/* ftruncate and friends, buffered writes happened before */
+	if( fi != NULL ) {
+		res = ll_flush( data, fi );
+		if( res < 0 ) {
+			fuse_reply_err( req, -res );
+			return;
+		}
+	}
+
+	res = ll_setattr( data, ino, attr, to_set, &stbuf );
+	if( res < 0 ) {
+		fuse_reply_err( req, -res );
+		return;
+	}
+
+	fuse_reply_attr( req, &stbuf, data->kernel_attr_ttl );
+}
+
+static void pgfuse_ll_readlink( fuse_req_t req, fuse_ino_t ino )
+{
+	PgFuseData *data = (PgFuseData *)fuse_req_userdata( req );
+	char *link = NULL;
+	int res;
+
+	res = ll_readlink( data, ino, &link );
+	if( res < 0 ) {
+		fuse_reply_err( req, -res );
+		return;
+	}
+
+	fuse_reply_readlink( req, link );
+
+	free( link );
+}
+
+static void pgfuse_ll_mkdir( fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode )
+{
+	PgFuseData *data = (PgFuseData *)fuse_req_userdata( req );
+	struct fuse_entry_param e;
+	int res;
+
+	/* S_IFDIR is not set by fuse */
+	res = ll_mknode( data, fuse_req_ctx( req ), parent, name, mode | S_IFDIR, NULL, &e );
+	if( res < 0 ) {
+		fuse_reply_err( req, -res );
+		return;
+	}
+
+	fuse_reply_entry( req, &e );
+}
+
+static void pgfuse_ll_unlink( fuse_req_t req, fuse_ino_t parent, const char *name )
+{
+	PgFuseData *data = (PgFuseData *)fuse_req_userdata( req );
+
+	fuse_reply_err( req, -ll_remove( data, parent, name, 0 ) );
+}
+
+static void pgfuse_ll_rmdir( fuse_req_t req, fuse_ino_t parent, const char *name )
+{
+	PgFuseData *data = (PgFuseData *)fuse_req_userdata( req );
+
+	fuse_reply_err( req, -ll_remove( data, parent, name, 1 ) );
+}
+
+static void pgfuse_ll_symlink( fuse_req_t req, const char *link, fuse_ino_t parent, const char *name )
+{
+	PgFuseData *data = (PgFuseData *)fuse_req_userdata( req );
+	struct fuse_entry_param e;
+	int res;
+
+	/* symlinks have no modes per se */
+	res = ll_mknode( data, fuse_req_ctx( req ), parent, name, 0777 | S_IFLNK, link, &e );
+	if( res < 0 ) {
+		fuse_reply_err( req, -res );
+		return;
+	}
+
+	fuse_reply_entry( req, &e );
+}
+
+static void pgfuse_ll_rename( fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname )
+{
+	PgFuseData *data = (PgFuseData *)fuse_req_userdata( req );
+
+	fuse_reply_err( req, -ll_rename( data, parent, name, newparent, newname ) );
+}
+
+static void pgfuse_ll_open( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi )
+{
+	PgFuseData *data = (PgFuseData *)fuse_req_userdata( req );
+	int res;
+
+	res = ll_open( data, ino, fi );
+	if( res < 0 ) {
+		fuse_reply_err( req, -res );
+		return;
+	}
+
+	if( fuse_reply_open( req, fi ) != 0 ) {
+		pgfuse_file_close( PGFUSE_FILE( fi ) );
+	}
+}
+
+static void pgfuse_ll_read( fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi )
+{
+	PgFuseData *data = (PgFuseData *)fuse_req_userdata( req );
+	char *buf;
+	int res;
+
+	buf = (char *)malloc( size );
+	if( buf == NULL ) {
+		fuse_reply_err( req, ENOMEM );
+		return;
+	}
+
+	res = ll_read( data, ino, buf, size, off, fi );
+	if( res < 0 ) {
+		fuse_reply_err( req, -res );
+	} else {
+		fuse_reply_buf( req, buf, res );
+	}
+
+	free( buf );
+}
+
+static void pgfuse_ll_write( fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi )
+{
+	PgFuseData *data = (PgFuseData *)fuse_req_userdata( req );
+	int res;
+
+	res = ll_write( data, ino, buf, size, off, fi );
+	if( res < 0 ) {
+		fuse_reply_err( req, -res );
+		return;
+	}
+
+	fuse_reply_write( req, res );
+}
+
+static void pgfuse_ll_flush( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi )
+{
+	PgFuseData *data = (PgFuseData *)fuse_req_userdata( req );
+
+	/* write the buffered data, so errors are reported by close */
+	fuse_reply_err( req, -ll_flush( data, fi ) );
+}
+
+static void pgfuse_ll_release( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi )
+{
+	PgFuseData *data = (PgFuseData *)fuse_req_userdata( req );
+	int res;
+
+	/* normally already written by flush */
+	res = ll_flush( data, fi );
+
+	pgfuse_file_close( PGFUSE_FILE( fi ) );
+
+	fuse_reply_err( req, -res );
+}
+
+static void pgfuse_ll_fsync( fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi )
+{
+	PgFuseData *data = (PgFuseData *)fuse_req_userdata( req );
+
+	if( data->read_only ) {
+		fuse_reply_err( req, EROFS );
+		return;
+	}
+
+	/* buffered data gets committed, the rest is persistent in the database */
+	fuse_reply_err( req, -ll_flush( data, fi ) );
+}
+
+static void pgfuse_ll_opendir( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi )
+{
+	PgFuseData *data = (PgFuseData *)fuse_req_userdata( req );
+	PgDirBuf *b;
+	int res;
+
+	res = ll_opendir( data, req, ino, &b );
+	if( res < 0 ) {
+		fuse_reply_err( req, -res );
+		return;
+	}
+
+	fi->fh = (uintptr_t)b;
+
+	if( fuse_reply_open( req, fi ) != 0 ) {
+		dirbuf_free( b );
+	}
+}
+
+static void pgfuse_ll_readdir( fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi )
+{
+	PgDirBuf *b = (PgDirBuf *)(uintptr_t)fi->fh;
+
+	if( off >= b->size ) {
+		fuse_reply_buf( req, NULL, 0 );
+		return;
+	}
+
+	fuse_reply_buf( req, b->p + off, ( b->size - off < size ) ? b->size - off : size );
+}
+
+static void pgfuse_ll_releasedir( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi )
+{
+	dirbuf_free( (PgDirBuf *)(uintptr_t)fi->fh );
+
+	fuse_reply_err( req, 0 );
+}
+
+static void pgfuse_ll_fsyncdir( fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi )
+{
+	/* nothing to do, everything is done in the database */
+	fuse_reply_err( req, 0 );
+}
+
+static void pgfuse_ll_statfs( fuse_req_t req, fuse_ino_t ino )
+{
+	PgFuseData *data = (PgFuseData *)fuse_req_userdata( req );
+	struct statvfs buf;
+	int res;
+
+	res = pgfuse_statfs_data( data, &buf );
+	if( res < 0 ) {
+		fuse_reply_err( req, -res );
+		return;
+	}
+
+	fuse_reply_statfs( req, &buf );
+}
+
+static void pgfuse_ll_access( fuse_req_t req, fuse_ino_t ino, int mask )
+{
+	/* TODO: check access, but not now. grant always access */
+	fuse_reply_err( req, 0 );
+}
+
+static void pgfuse_ll_create( fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi )
+{
+	PgFuseData *data = (PgFuseData *)fuse_req_userdata( req );
+	struct fuse_entry_param e;
+	int res;
+
+	res = ll_mknode( data, fuse_req_ctx( req ), parent, name, mode, NULL, &e );
+	if( res < 0 ) {
+		fuse_reply_err( req, -res );
+		return;
+	}
+
+	fi->fh = (uintptr_t)pgfuse_file_open( data, INO_TO_ID( e.ino ), NULL );
+	if( fi->fh == 0 ) {
+		fuse_reply_err( req, ENOMEM );
+		return;
+	}
+
+	if( fuse_reply_create( req, &e, fi ) != 0 ) {
+		pgfuse_file_close( PGFUSE_FILE( fi ) );
+	}
+}
+
+static struct fuse_lowlevel_ops pgfuse_ll_oper = {
+	.init		= pgfuse_ll_init,
+	.destroy	= pgfuse_ll_destroy,
+	.lookup		= pgfuse_ll_lookup,
+	.forget		= pgfuse_ll_forget,
+	.getattr	= pgfuse_ll_getattr,
+	.setattr	= pgfuse_ll_setattr,
+	.readlink	= pgfuse_ll_readlink,
+	.mknod		= NULL,		/* not used, we use 'create' */
+	.mkdir		= pgfuse_ll_mkdir,
+	.unlink		= pgfuse_ll_unlink,
+	.rmdir		= pgfuse_ll_rmdir,
+	.symlink	= pgfuse_ll_symlink,
+	.rename		= pgfuse_ll_rename,
+	.link		= NULL,
+	.open		= pgfuse_ll_open,
+	.read		= pgfuse_ll_read,
+	.write		= pgfuse_ll_write,
+	.flush		= pgfuse_ll_flush,
+	.release	= pgfuse_ll_release,
+	.fsync		= pgfuse_ll_fsync,
+	.opendir	= pgfuse_ll_opendir,
+	.readdir	= pgfuse_ll_readdir,
+	.releasedir	= pgfuse_ll_releasedir,
+	.fsyncdir	= pgfuse_ll_fsyncdir,
+	.statfs		= pgfuse_ll_statfs,
+	.setxattr	= NULL,
+	.getxattr	= NULL,
+	.listxattr	= NULL,
+	.removexattr	= NULL,
+	.access		= pgfuse_ll_access,
+	.create		= pgfuse_ll_create
+};
+
+/* --- invalidation of the kernel caches --- */
+
+/* the notifications are sent by a thread of their own, a request
+ * handler sending them could deadlock with the kernel which holds the
+ * locks of the inode during the request */
+typedef struct PgInval {
+	int64_t id;		/* inode to invalidate, or the parent of 'name' */
+	char *name;		/* entry to invalidate, NULL for the inode itself */
+	struct PgInval *next;
+} PgInval;
+
+static struct fuse_chan *inval_ch = NULL;
+static PgInval *inval_head = NULL;
+static PgInval *inval_tail = NULL;
+static pthread_mutex_t inval_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inval_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t inval_thread;
+static int inval_stop = 0;
+
+static void queue_inval( const int64_t id, const char *name )
+{
+	PgInval *i;
+	
+	(void)pthread_mutex_lock( &inval_lock );
+	if( inval_ch == NULL ) {
+		(void)pthread_mutex_unlock( &inval_lock );
+		return;
+	}
+	(void)pthread_mutex_unlock( &inval_lock );
+	
+	i = (PgInval *)malloc( sizeof( PgInval ) );
+	if( i == NULL ) return;
+	i->id = id;
+	i->name = NULL;
+	i->next = NULL;
+	if( name != NULL ) {
+		i->name = strdup( name );
+		if( i->name == NULL ) {
+			free( i );
+			return;
+		}
+	}
+	
+	(void)pthread_mutex_lock( &inval_lock );
+	if( inval_tail != NULL ) {
+		inval_tail->next = i;
+	} else {
+		inval_head = i;
+	}
+	inval_tail = i;
+	(void)pthread_cond_signal( &inval_cond );
+	(void)pthread_mutex_unlock( &inval_lock );
+}
+
+static void *inval_main( void *arg )
+{
+	PgInval *i;
+	int res;
+	
+	(void)pthread_mutex_lock( &inval_lock );
+	
+	for( ;; ) {
+		while( inval_head == NULL && !inval_stop ) {
+			(void)pthread_cond_wait( &inval_cond, &inval_lock );
+		}
+		if( inval_head == NULL ) break;
+		
+		i = inval_head;
+		inval_head = i->next;
+		if( inval_head == NULL ) inval_tail = NULL;
+		(void)pthread_mutex_unlock( &inval_lock );
+		
+		/* -ENOENT: the kernel doesn't know the inode or entry */
+#if FUSE_VERSION >= 28
+		if( i->name != NULL ) {
+			res = fuse_lowlevel_notify_inval_entry( inval_ch, ID_TO_INO( i->id ), i->name, strlen( i->name ) );
+		} else {
+			res = fuse_lowlevel_notify_inval_inode( inval_ch, ID_TO_INO( i->id ), 0, 0 );
+		}
+#else
+		res = 0;
+#endif
+		if( res < 0 && res != -ENOENT ) {
+			syslog( LOG_WARNING, "Invalidating kernel cache of inode %"PRIi64" failed: %d", i->id, res );
+		}
+		
+		free( i->name );
+		free( i );
+		
+		(void)pthread_mutex_lock( &inval_lock );
+	}
+	
+	(void)pthread_mutex_unlock( &inval_lock );
+	
+	return NULL;
+}
+
+static int inval_start( struct fuse_chan *ch )
+{
+	int res;
+	
+	inval_ch = ch;
+	inval_stop = 0;
+	
+	res = pthread_create( &inval_thread, NULL, inval_main, NULL );
+	if( res != 0 ) {
+		inval_ch = NULL;
+		return -res;
+	}
+	
+	return 0;
+}
+
+static void inval_shutdown( void )
+{
+	(void)pthread_mutex_lock( &inval_lock );
+	inval_stop = 1;
+	(void)pthread_cond_signal( &inval_cond );
+	(void)pthread_mutex_unlock( &inval_lock );
+	
+	(void)pthread_join( inval_thread, NULL );
+	
+	(void)pthread_mutex_lock( &inval_lock );
+	inval_ch = NULL;
+	(void)pthread_mutex_unlock( &inval_lock );
+}
+
+void pgfuse_invalidate_inode( PgFuseData *data, const int64_t id )
+{
+	queue_inval( id, NULL );
+}
+
+void pgfuse_invalidate_entry( PgFuseData *data, const int64_t parent_id, const char *name )
+{
+	queue_inval( parent_id, name );
+}
+
+/* --- main loop of the low-level frontend --- */
+
+int pgfuse_lowlevel_main( struct fuse_args *args, PgFuseData *data )
+{
+	char *mountpoint;
+	int multi_threaded;
+	int foreground;
+	struct fuse_chan *ch;
+	struct fuse_session *se;
+	int res = -1;
+
+	if( fuse_parse_cmdline( args, &mountpoint, &multi_threaded, &foreground ) < 0 ) {
+		return 1;
+	}
+
+	ch = fuse_mount( mountpoint, args );
+	if( ch == NULL ) {
+		free( mountpoint );
+		return 1;
+	}
+
+	se = fuse_lowlevel_new( args, &pgfuse_ll_oper, sizeof( pgfuse_ll_oper ), data );
+	if( se != NULL ) {
+		if( fuse_set_signal_handlers( se ) != -1 ) {
+			fuse_session_add_chan( se, ch );
+
+			if( fuse_daemonize( foreground ) != -1 && inval_start( ch ) == 0 ) {
+				if( multi_threaded ) {
+					res = fuse_session_loop_mt( se );
+				} else {
+					res = fuse_session_loop( se );
+				}
+				inval_shutdown( );
+			}
+
+			fuse_remove_signal_handlers( se );
+			fuse_session_remove_chan( ch );
+		}
+		fuse_session_destroy( se );
+	}
+
+	fuse_unmount( mountpoint, ch );
+	free( mountpoint );
+
+	return ( res == 0 ) ? 0 : 1;
+}
+
+#else
+
+int pgfuse_lowlevel_main( struct fuse_args *args, PgFuseData *data )
+{
+	fprintf( stderr, "The low-level frontend needs FUSE 2.7 or newer\n" );
+
+	return 1;
+}
+
+void pgfuse_invalidate_inode( PgFuseData *data, const int64_t id )
+{
+}
+
+void pgfuse_invalidate_entry( PgFuseData *data, const int64_t parent_id, const char *name )
+{
+}
+
+#endif
@@ -44,23 +44,13 @@
 #include "config.h"		/* compiled in defaults */
 #include "pgsql.h"		/* implements Postgresql accessers */
 #include "pool.h"		/* implements the connection pool */
-
-/* --- FUSE private context data --- */
-
-typedef struct PgFuseData {
-	int verbose;		/* whether we should be verbose */
-	char *conninfo;		/* connection info as used in PQconnectdb */
-	char *mountpoint;	/* where we mount the virtual filesystem */
-	PGconn *conn;		/* the database handle to operate on (single-thread only) */
-	PgConnPool pool;	/* the database pool to operate on (multi-thread only) */
-	int read_only;		/* whether the mount point is read-only */
-	int multi_threaded;	/* whether we run multi-threaded */
-	size_t block_size;	/* block size to use for storage of data in bytea fields */
-} PgFuseData;
+#include "cache.h"		/* implements the metadata caches */
+#include "pgfuse.h"		/* shared data of the FUSE frontends */
+#include "file.h"		/* open file handles with write-back buffer */
 
 /* --- timestamp helpers --- */
 
-static struct timespec now( void )
+struct timespec pgfuse_now( void )
 {
 	int res;
 	struct timeval t;
@@ -82,37 +72,65 @@ static struct timespec now( void )
 
 /* --- pool helpers --- */
 
-static PGconn *psql_acquire( PgFuseData *data )
+PGconn *psql_acquire( PgFuseData *data )
 {
 	if( !data->multi_threaded ) {
+		/* the database restarted or failed over */
+		if( PQstatus( data->conn ) != CONNECTION_OK ) {
+			if( psql_reconnect( data->conn ) < 0 ) {
+				return NULL;
+			}
+		}
 		return data->conn;
 	}
 	
 	return psql_pool_acquire( &data->pool );
 }
 
-static int psql_release( PgFuseData *data, PGconn *conn )
+/* the connection to the replica a thread holds */
+static pthread_key_t replica_conn_key;
+static pthread_once_t replica_conn_once = PTHREAD_ONCE_INIT;
+
+static void replica_conn_init( void )
 {
-	if( !data->multi_threaded ) return 0;
-	
-	return psql_pool_release( &data->pool, conn );
+	(void)pthread_key_create( &replica_conn_key, NULL );
 }
 
-#define ACQUIRE( C ) \
-	C = psql_acquire( data ); \
-	if( C == NULL ) return -EIO;
+PGconn *psql_acquire_read( PgFuseData *data )
+{
+	PGconn *conn;
+	
+	if( data->replica_conninfo != NULL ) {
+		conn = psql_replica_acquire( &data->replica );
+		if( conn != NULL ) {
+			(void)pthread_once( &replica_conn_once, replica_conn_init );
+			(void)pthread_setspecific( replica_conn_key, conn );
+			return conn;
+		}
+	}
 	
-#define RELEASE( C ) \
-	if( psql_release( data, C ) < 0 ) return -EIO;
+	return psql_acquire( data );
+}
 
-#define THREAD_ID (unsigned int)pthread_self( )
+int psql_release( PgFuseData *data, PGconn *conn )
+{
+	if( data->replica_conninfo != NULL ) {
+		(void)pthread_once( &replica_conn_once, replica_conn_init );
+		if( pthread_getspecific( replica_conn_key ) == conn ) {
+			(void)pthread_setspecific( replica_conn_key, NULL );
+			return psql_replica_release( &data->replica, conn );
+		}
+	}
+	
+	if( !data->multi_threaded ) return 0;
+	
+	return psql_pool_release( &data->pool, conn );
+}
 
-/* --- implementation of FUSE hooks --- */
+/* --- setup and teardown --- */
 
-static void *pgfuse_init( struct fuse_conn_info *conn )
+void pgfuse_setup( PgFuseData *data )
 {
-	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
-	
 	syslog( LOG_INFO, "Mounting file system on '%s' ('%s', %s), thread #%u",
 		data->mountpoint, data->conninfo,
 		data->read_only ? "read-only" : "read-write",
@@ -127,37 +145,199 @@ static void *pgfuse_init( struct fuse_conn_info *conn )
 			PQfinish( data->conn );
 			exit( EXIT_FAILURE );
 		}
+		if( psql_prepare_statements( data->conn ) < 0 ) {
+			PQfinish( data->conn );
+			exit( EXIT_FAILURE );
+		}
 	} else {
 		int res;
 
-		res = psql_pool_init( &data->pool, data->conninfo, MAX_DB_CONNECTIONS );
+		res = psql_pool_init( &data->pool, data->conninfo, data->pool_min, data->pool_max );
 		if( res < 0 ) {
 			syslog( LOG_ERR, "Allocating database connection pool failed!" );
 			exit( EXIT_FAILURE );
 		}
 	}
 	
-	return data;
+	if( data->dentry_cache_size > 0 ) {
+		int res;
+		
+		res = psql_dentry_cache_init( &data->dentry_cache, data->dentry_cache_size, data->dentry_cache_ttl );
+		if( res < 0 ) {
+			syslog( LOG_ERR, "Allocating dentry cache failed!" );
+			exit( EXIT_FAILURE );
+		}
+		psql_set_dentry_cache( &data->dentry_cache );
+	}
+	
+	if( data->negative_cache_size > 0 ) {
+		int res;
+		
+		res = psql_dentry_cache_init( &data->negative_cache, data->negative_cache_size, data->negative_cache_ttl );
+		if( res < 0 ) {
+			syslog( LOG_ERR, "Allocating negative cache failed!" );
+			exit( EXIT_FAILURE );
+		}
+		psql_set_negative_cache( &data->negative_cache );
+	}
+	
+	if( data->attr_cache_size > 0 ) {
+		int res;
+		
+		res = psql_meta_cache_init( &data->attr_cache, data->attr_cache_size, data->attr_cache_ttl );
+		if( res < 0 ) {
+			syslog( LOG_ERR, "Allocating attribute cache failed!" );
+			exit( EXIT_FAILURE );
+		}
+		psql_set_meta_cache( &data->attr_cache );
+	}
+	
+	if( data->block_cache_size > 0 ) {
+		int res;
+		
+		res = psql_block_cache_init( &data->block_cache, data->block_cache_size, data->block_size, data->block_cache_ttl );
+		if( res < 0 ) {
+			syslog( LOG_ERR, "Allocating block cache failed!" );
+			exit( EXIT_FAILURE );
+		}
+		psql_set_block_cache( &data->block_cache );
+	}
+	
+	if( data->meta_flush_interval > 0 && !data->read_only ) {
+		int res;
+		
+		res = psql_flusher_start( &data->flusher, data->conninfo, data->meta_flush_interval );
+		if( res < 0 ) {
+			syslog( LOG_ERR, "Starting metadata flusher failed!" );
+			exit( EXIT_FAILURE );
+		}
+		psql_set_lazy_meta( 1 );
+	}
+	
+	/* the single connection can't be shared with a background thread,
+	 * aged buffers are written with the next write or flush then */
+	if( data->multi_threaded && data->write_buffer_size > 0 && data->write_buffer_age > 0 && !data->read_only ) {
+		if( pgfuse_file_ager_start( data ) < 0 ) {
+			syslog( LOG_ERR, "Starting the write buffer ager failed!" );
+			exit( EXIT_FAILURE );
+		}
+	}
+	
+	if( data->replica_conninfo != NULL ) {
+		int res;
+		
+		res = psql_replica_start( &data->replica, data->conninfo, data->replica_conninfo,
+			data->pool_min, data->pool_max, data->replica_poll_interval, data->replica_max_lag );
+		if( res < 0 ) {
+			syslog( LOG_ERR, "Setting up the read replica failed!" );
+			exit( EXIT_FAILURE );
+		}
+	}
+	
+	if( data->notify ) {
+		int res;
+		
+		res = psql_listener_start( &data->listener, data, data->conninfo );
+		if( res < 0 ) {
+			syslog( LOG_ERR, "Starting the change listener failed!" );
+			exit( EXIT_FAILURE );
+		}
+	}
 }
 
-static void pgfuse_destroy( void *userdata )
+void pgfuse_teardown( PgFuseData *data )
 {
-	PgFuseData *data = (PgFuseData *)userdata;
-	
 	syslog( LOG_INFO, "Unmounting file system on '%s' (%s), thread #%u",
 		data->mountpoint, data->conninfo, THREAD_ID );
 
+	if( data->notify ) {
+		(void)psql_listener_stop( &data->listener );
+	}
+
+	if( data->multi_threaded && data->write_buffer_size > 0 && data->write_buffer_age > 0 && !data->read_only ) {
+		pgfuse_file_ager_stop( );
+	}
+
+	if( data->replica_conninfo != NULL ) {
+		(void)psql_replica_stop( &data->replica );
+	}
+
+	if( data->meta_flush_interval > 0 && !data->read_only ) {
+		(void)psql_flusher_stop( &data->flusher );
+		psql_set_lazy_meta( 0 );
+	}
+
 	if( !data->multi_threaded ) {
 		PQfinish( data->conn );
 	} else {
+		uint64_t acquires;
+		uint64_t waits;
+		uint64_t wait_us;
+		uint64_t max_wait_us;
+		
+		psql_pool_stats( &data->pool, &acquires, &waits, &wait_us, &max_wait_us );
+		syslog( LOG_INFO, "Connection pool on '%s': %"PRIu64" acquires, %"PRIu64" took the lock, %"PRIu64" us waited in total, %"PRIu64" us at most",
+			data->mountpoint, acquires, waits, wait_us, max_wait_us );
+		
 		(void)psql_pool_destroy( &data->pool );
 	}
+	
+	if( data->dentry_cache_size > 0 ) {
+		psql_set_dentry_cache( NULL );
+		(void)psql_dentry_cache_destroy( &data->dentry_cache );
+	}
+	
+	if( data->negative_cache_size > 0 ) {
+		psql_set_negative_cache( NULL );
+		(void)psql_dentry_cache_destroy( &data->negative_cache );
+	}
+	
+	if( data->attr_cache_size > 0 ) {
+		psql_set_meta_cache( NULL );
+		(void)psql_meta_cache_destroy( &data->attr_cache );
+	}
+	
+	if( data->block_cache_size > 0 ) {
+		uint64_t hits;
+		uint64_t misses;
+		
+		psql_block_cache_stats( &data->block_cache, &hits, &misses );
+		syslog( LOG_INFO, "Block cache on '%s': %"PRIu64" hits, %"PRIu64" misses",
+			data->mountpoint, hits, misses );
+		
+		psql_set_block_cache( NULL );
+		(void)psql_block_cache_destroy( &data->block_cache );
+	}
+	
+	pgfuse_file_free_all( );
+}
+
+/* --- implementation of FUSE hooks --- */
+
+static void *pgfuse_init( struct fuse_conn_info *conn )
+{
+	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
+	
+	if( data->verbose ) {
+		syslog( LOG_INFO, "Kernel requests on '%s' up to %u bytes written, %u bytes read ahead",
+			data->mountpoint, conn->max_write, conn->max_readahead );
+	}
+	
+	pgfuse_setup( data );
+	
+	return data;
+}
+
+static void pgfuse_destroy( void *userdata )
+{
+	pgfuse_teardown( (PgFuseData *)userdata );
 }
 
 static int pgfuse_fgetattr( const char *path, struct stat *stbuf, struct fuse_file_info *fi )
 {
 	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
 	int64_t id;
+	int res;
 	PgMeta meta;
 	PGconn *conn;
 	
@@ -166,12 +346,18 @@ static int pgfuse_fgetattr( const char *path, struct stat *stbuf, struct fuse_fi
 			path, data->mountpoint, THREAD_ID );
 	}
 
-	ACQUIRE( conn );
+	/* the size must include the buffered writes */
+	res = pgfuse_file_flush_buffer( data, PGFUSE_FILE( fi ), path );
+	if( res < 0 ) {
+		return res;
+	}
+
+	ACQUIRE_READ( conn );
 	PSQL_BEGIN( conn );
 	
 	memset( stbuf, 0, sizeof( struct stat ) );
 
-	id = psql_read_meta( conn, fi->fh, path, &meta );
+	id = psql_read_meta( conn, PGFUSE_FILE( fi )->id, path, &meta );
 	if( id < 0 ) {
 		PSQL_ROLLBACK( conn ); RELEASE( conn );
 		return id;
@@ -212,7 +398,7 @@ static int pgfuse_getattr( const char *path, struct stat *stbuf )
 			path, data->mountpoint, THREAD_ID );
 	}
 
-	ACQUIRE( conn );
+	ACQUIRE_READ( conn );
 	PSQL_BEGIN( conn );
 	
 	memset( stbuf, 0, sizeof( struct stat ) );
@@ -371,7 +557,7 @@ static int pgfuse_create( const char *path, mode_t mode, struct fuse_file_info *
 	meta.mode = mode;
 	meta.uid = fuse_get_context( )->uid;
 	meta.gid = fuse_get_context( )->gid;
-	meta.ctime = now( );
+	meta.ctime = pgfuse_now( );
 	meta.mtime = meta.ctime;
 	meta.atime = meta.ctime;
 	
@@ -394,13 +580,26 @@ static int pgfuse_create( const char *path, mode_t mode, struct fuse_file_info *
 			path, id, THREAD_ID );
 	}
 	
-	fi->fh = id;
-	
 	free( copy_path );
 
-	PSQL_COMMIT( conn ); RELEASE( conn );
+	fi->fh = (uintptr_t)pgfuse_file_open( data, id, &meta );
+	if( fi->fh == 0 ) {
+		syslog( LOG_ERR, "Out of memory in Create '%s'!", path );
+		PSQL_ROLLBACK( conn ); RELEASE( conn );
+		return -ENOMEM;
+	}
+
+	/* FUSE doesn't release the handle of a failed create */
+	res = psql_commit( conn );
+	if( res < 0 ) {
+		pgfuse_file_close( PGFUSE_FILE( fi ) );
+		fi->fh = 0;
+		RELEASE( conn );
+		return res;
+	}
+	RELEASE( conn );
 	
-	return res;
+	return 0;
 }
 
 
@@ -409,7 +608,6 @@ static int pgfuse_open( const char *path, struct fuse_file_info *fi )
 	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
 	PgMeta meta;
 	int64_t id;
-	int64_t res;
 	PGconn *conn;
 
 	if( data->verbose ) {
@@ -445,13 +643,13 @@ static int pgfuse_open( const char *path, struct fuse_file_info *fi )
 		}
 	}
 	
-	res = psql_write_meta( conn, id, path, meta );
-	if( res < 0 ) {
+	/* open is a pure read, the access time is set by reads (see atime policy) */
+	fi->fh = (uintptr_t)pgfuse_file_open( data, id, &meta );
+	if( fi->fh == 0 ) {
+		syslog( LOG_ERR, "Out of memory in Open '%s'!", path );
 		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return res;
-	}	
-		
-	fi->fh = id;
+		return -ENOMEM;
+	}
 
 	PSQL_COMMIT( conn ); RELEASE( conn );
 	
@@ -478,7 +676,7 @@ static int pgfuse_readdir( const char *path, void *buf, fuse_fill_dir_t filler,
 			path, data->mountpoint, THREAD_ID );
 	}
 	
-	ACQUIRE( conn );	
+	ACQUIRE_READ( conn );	
 	PSQL_BEGIN( conn );
 	
 	filler( buf, ".", NULL, 0 );
@@ -577,7 +775,7 @@ static int pgfuse_mkdir( const char *path, mode_t mode )
 	meta.mode = mode | S_IFDIR; /* S_IFDIR is not set by fuse */
 	meta.uid = fuse_get_context( )->uid;
 	meta.gid = fuse_get_context( )->gid;
-	meta.ctime = now( );
+	meta.ctime = pgfuse_now( );
 	meta.mtime = meta.ctime;
 	meta.atime = meta.ctime;
 	
@@ -691,9 +889,10 @@ static int pgfuse_unlink( const char *path )
 
 static int pgfuse_flush( const char *path, struct fuse_file_info *fi )
 {
-	/* nothing to do, data is always persistent in database */
+	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
 
-	return 0;
+	/* write the buffered data, so errors are reported by close */
+	return pgfuse_file_flush( data, PGFUSE_FILE( fi ), path );
 }
 
 static int pgfuse_fsync( const char *path, int isdatasync, struct fuse_file_info *fi )
@@ -710,39 +909,37 @@ static int pgfuse_fsync( const char *path, int isdatasync, struct fuse_file_info
 		return -EROFS;
 	}
 
-	if( fi->fh == 0 ) {
+	if( PGFUSE_FILE( fi ) == NULL ) {
 		return -EBADF;
 	}
 	
-	/* nothing to do, data is always persistent in database */
-	
-	/* TODO: if we have a per transaction/file transaction policy, we must change this here! */
+	/* buffered data gets committed, the rest is persistent in the database */
 	
-	return 0;
+	return pgfuse_file_flush( data, PGFUSE_FILE( fi ), path );
 }
 
 static int pgfuse_release( const char *path, struct fuse_file_info *fi )
 {
 	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
+	int res;
 
-	/* nothing to do given the simple transaction model */
-	
 	if( data->verbose ) {
 		syslog( LOG_INFO, "Releasing '%s' on '%s', thread #%u",
 			path, data->mountpoint, THREAD_ID );
 	}
 
-	return 0;
+	/* normally already written by flush */
+	res = pgfuse_file_flush( data, PGFUSE_FILE( fi ), path );
+	
+	pgfuse_file_close( PGFUSE_FILE( fi ) );
+
+	return res;
 }
 
 static int pgfuse_write( const char *path, const char *buf, size_t size,
                          off_t offset, struct fuse_file_info *fi )
 {
 	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
-	int64_t tmp;
-	int res;
-	PgMeta meta;
-	PGconn *conn;
 
 	if( data->verbose ) {
 		syslog( LOG_INFO, "Write to '%s' from offset %jd, size %zu on '%s', thread #%u",
@@ -750,58 +947,21 @@ static int pgfuse_write( const char *path, const char *buf, size_t size,
 			THREAD_ID );
 	}
 
-	ACQUIRE( conn );
-	PSQL_BEGIN( conn );
-	
-	if( fi->fh == 0 ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
+	if( PGFUSE_FILE( fi ) == NULL ) {
 		return -EBADF;
 	}
 
 	if( data->read_only ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
 		return -EBADF;
 	}
-		
-	tmp = psql_read_meta( conn, fi->fh, path, &meta );
-	if( tmp < 0 ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return tmp;
-	}
-	
-	if( offset + size > meta.size ) {
-		meta.size = offset + size;
-	}
 	
-	res = psql_write_buf( conn, data->block_size, fi->fh, path, buf, offset, size, data->verbose );
-	if( res < 0 ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return res;
-	}
-	if( res != size ) {
-		syslog( LOG_ERR, "Write size mismatch in file '%s' on mountpoint '%s', expected '%d' to be written, but actually wrote '%d' bytes! Data inconistency!",
-			path, data->mountpoint, (unsigned int)size, res );
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return -EIO;
-	}
-	
-	res = psql_write_meta( conn, fi->fh, path, meta );
-	if( res < 0 ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return res;
-	}
-
-	PSQL_COMMIT( conn ); RELEASE( conn );
-	
-	return size;
+	return pgfuse_file_write( data, PGFUSE_FILE( fi ), path, buf, size, offset );
 }
 
 static int pgfuse_read( const char *path, char *buf, size_t size,
                         off_t offset, struct fuse_file_info *fi )
 {
 	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
-	int res;
-	PGconn *conn;
 
 	if( data->verbose ) {
 		syslog( LOG_INFO, "Read to '%s' from offset %jd, size %zu on '%s', thread #%u",
@@ -809,23 +969,11 @@ static int pgfuse_read( const char *path, char *buf, size_t size,
 			THREAD_ID );
 	}
 
-	ACQUIRE( conn );
-	PSQL_BEGIN( conn );
-
-	if( fi->fh == 0 ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
+	if( PGFUSE_FILE( fi ) == NULL ) {
 		return -EBADF;
 	}
 
-	res = psql_read_buf( conn, data->block_size, fi->fh, path, buf, offset, size, data->verbose );
-	if( res < 0 ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
-		return res;
-	}
-
-	PSQL_COMMIT( conn ); RELEASE( conn );
-		
-	return res;
+	return pgfuse_file_read( data, PGFUSE_FILE( fi ), path, buf, size, offset );
 }
 
 static int pgfuse_truncate( const char* path, off_t offset )
@@ -897,15 +1045,20 @@ static int pgfuse_ftruncate( const char *path, off_t offset, struct fuse_file_in
 			THREAD_ID );
 	}
 
-	ACQUIRE( conn );
-	PSQL_BEGIN( conn );
-
-	if( fi->fh == 0 ) {
-		PSQL_ROLLBACK( conn ); RELEASE( conn );
+	if( PGFUSE_FILE( fi ) == NULL ) {
 		return -EBADF;
 	}
+
+	/* buffered writes happened before the truncate */
+	res = pgfuse_file_flush( data, PGFUSE_FILE( fi ), path );
+	if( res < 0 ) {
+		return res;
+	}
+
+	ACQUIRE( conn );
+	PSQL_BEGIN( conn );
 	
-	id = psql_read_meta( conn, fi->fh, path, &meta );
+	id = psql_read_meta( conn, PGFUSE_FILE( fi )->id, path, &meta );
 	if( id < 0 ) {
 		PSQL_ROLLBACK( conn ); RELEASE( conn );
 		return id;
@@ -916,7 +1069,7 @@ static int pgfuse_ftruncate( const char *path, off_t offset, struct fuse_file_in
 		return -EROFS;
 	}
 	
-	res = psql_truncate( conn, data->block_size, fi->fh, path, offset );
+	res = psql_truncate( conn, data->block_size, id, path, offset );
 	if( res < 0 ) {
 		PSQL_ROLLBACK( conn ); RELEASE( conn );
 		return res;
@@ -924,7 +1077,7 @@ static int pgfuse_ftruncate( const char *path, off_t offset, struct fuse_file_in
 	
 	meta.size = offset;
 	
-	res = psql_write_meta( conn, fi->fh, path, meta );
+	res = psql_write_meta( conn, id, path, meta );
 	if( res < 0 ) {
 		PSQL_ROLLBACK( conn ); RELEASE( conn );
 		return res;
@@ -935,9 +1088,8 @@ static int pgfuse_ftruncate( const char *path, off_t offset, struct fuse_file_in
 	return 0;
 }
 
-static int pgfuse_statfs( const char *path, struct statvfs *buf )
+int pgfuse_statfs_data( PgFuseData *data, struct statvfs *buf )
 {
-	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
 	PGconn *conn;
 	int64_t blocks_total, blocks_used, blocks_free, blocks_avail;
 	int64_t files_total, files_used, files_free, files_avail;
@@ -959,7 +1111,7 @@ static int pgfuse_statfs( const char *path, struct statvfs *buf )
 		
 	memset( buf, 0, sizeof( struct statvfs ) );
 	
-	ACQUIRE( conn );
+	ACQUIRE_READ( conn );
         PSQL_BEGIN( conn );
 
 	/* blocks */
@@ -1096,6 +1248,13 @@ static int pgfuse_statfs( const char *path, struct statvfs *buf )
 	return 0;
 }
 
+static int pgfuse_statfs( const char *path, struct statvfs *buf )
+{
+	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
+	
+	return pgfuse_statfs_data( data, buf );
+}
+
 static int pgfuse_chmod( const char *path, mode_t mode )
 {
 	PgFuseData *data = (PgFuseData *)fuse_get_context( )->private_data;
@@ -1244,7 +1403,7 @@ static int pgfuse_symlink( const char *from, const char *to )
 	/* TODO: use FUSE context */
 	meta.uid = fuse_get_context( )->uid;
 	meta.gid = fuse_get_context( )->gid;
-	meta.ctime = now( );
+	meta.ctime = pgfuse_now( );
 	meta.mtime = meta.ctime;
 	meta.atime = meta.ctime;
 	
@@ -1393,7 +1552,7 @@ static int pgfuse_readlink( const char *path, char *buf, size_t size )
 			path, data->mountpoint, THREAD_ID );
 	}
 	
-	ACQUIRE( conn );	
+	ACQUIRE_READ( conn );	
 	PSQL_BEGIN( conn );
 
 	id = psql_read_meta_from_path( conn, path, &meta );
@@ -1516,6 +1675,31 @@ typedef struct PgFuseOptions {
 	int read_only;		/* whether to mount read-only */
 	int multi_threaded;	/* whether we run multi-threaded */
 	size_t block_size;	/* block size to use to store data in BYTEA fields */
+	unsigned int dentry_cache_size; /* number of entries in the dentry cache */
+	double dentry_cache_ttl;	/* seconds a cached dentry is valid */
+	unsigned int negative_cache_size; /* number of entries in the negative cache */
+	double negative_cache_ttl;	/* seconds a name is known not to exist */
+	unsigned int attr_cache_size;	/* number of entries in the attribute cache */
+	double attr_cache_ttl;		/* seconds cached metadata is valid */
+	unsigned int write_buffer_size;	/* bytes of small writes gathered per open file */
+	double write_buffer_age;	/* seconds after which buffered writes are written */
+	unsigned int read_ahead_size;	/* maximal bytes read ahead for sequential reads */
+	unsigned int max_request_size;	/* maximal bytes of a read or write request of the kernel */
+	unsigned int block_cache_size;	/* number of blocks in the block cache */
+	double block_cache_ttl;		/* seconds a cached block is valid */
+	double meta_flush_interval;	/* seconds between writes of file sizes and times */
+	unsigned int pool_min;		/* number of database connections kept open */
+	unsigned int pool_max;		/* maximum number of database connections */
+	char *replica_conninfo;		/* connection info of a hot standby for reads */
+	double kernel_attr_ttl;		/* seconds the kernel caches attributes, < 0 like attr_cache_ttl */
+	double kernel_entry_ttl;	/* seconds the kernel caches names, < 0 like dentry_cache_ttl */
+	int kernel_cache;		/* the kernel keeps cached file data over an open */
+	int auto_cache;			/* like kernel_cache if size and mtime didn't change */
+	int notify;			/* whether to listen for changes of other mounts */
+	unsigned int replica_max_lag;	/* bytes of WAL the standby may lag behind */
+	double replica_poll_interval;	/* seconds between two checks of the standby */
+	int lowlevel;			/* whether to use the inode based FUSE API */
+	int atime;			/* when reads update the access time */
 } PgFuseOptions;
 
 #define PGFUSE_OPT( t, p, v ) { t, offsetof( PgFuseOptions, p ), v }
@@ -1529,6 +1713,34 @@ enum {
 static struct fuse_opt pgfuse_opts[] = {
 	PGFUSE_OPT( 	"ro",		read_only, 1 ),
 	PGFUSE_OPT(     "blocksize=%d",	block_size, DEFAULT_BLOCK_SIZE ),
+	PGFUSE_OPT(     "dentry_cache_size=%u",	dentry_cache_size, 0 ),
+	PGFUSE_OPT(     "dentry_cache_ttl=%lf",	dentry_cache_ttl, 0 ),
+	PGFUSE_OPT(     "negative_cache_size=%u",	negative_cache_size, 0 ),
+	PGFUSE_OPT(     "negative_cache_ttl=%lf",	negative_cache_ttl, 0 ),
+	PGFUSE_OPT(     "attr_cache_size=%u",	attr_cache_size, 0 ),
+	PGFUSE_OPT(     "attr_cache_ttl=%lf",	attr_cache_ttl, 0 ),
+	PGFUSE_OPT(     "write_buffer_size=%u",	write_buffer_size, 0 ),
+	PGFUSE_OPT(     "write_buffer_age=%lf",	write_buffer_age, 0 ),
+	PGFUSE_OPT(     "read_ahead_size=%u",	read_ahead_size, 0 ),
+	PGFUSE_OPT(     "max_request_size=%u",	max_request_size, 0 ),
+	PGFUSE_OPT(     "block_cache_size=%u",	block_cache_size, 0 ),
+	PGFUSE_OPT(     "block_cache_ttl=%lf",	block_cache_ttl, 0 ),
+	PGFUSE_OPT(     "meta_flush_interval=%lf",	meta_flush_interval, 0 ),
+	PGFUSE_OPT(     "pool_min=%u",	pool_min, 0 ),
+	PGFUSE_OPT(     "pool_max=%u",	pool_max, 0 ),
+	PGFUSE_OPT(     "replica=%s",	replica_conninfo, 0 ),
+	PGFUSE_OPT(     "replica_max_lag=%u",	replica_max_lag, 0 ),
+	PGFUSE_OPT(     "replica_poll_interval=%lf",	replica_poll_interval, 0 ),
+	PGFUSE_OPT(     "kernel_attr_ttl=%lf",	kernel_attr_ttl, 0 ),
+	PGFUSE_OPT(     "kernel_entry_ttl=%lf",	kernel_entry_ttl, 0 ),
+	PGFUSE_OPT( 	"kernel_cache",	kernel_cache, 1 ),
+	PGFUSE_OPT( 	"auto_cache",	auto_cache, 1 ),
+	PGFUSE_OPT( 	"notify",	notify, 1 ),
+	PGFUSE_OPT( 	"nonotify",	notify, 0 ),
+	PGFUSE_OPT( 	"lowlevel",	lowlevel, 1 ),
+	PGFUSE_OPT( 	"noatime",	atime, PGFUSE_NOATIME ),
+	PGFUSE_OPT( 	"relatime",	atime, PGFUSE_RELATIME ),
+	PGFUSE_OPT( 	"strictatime",	atime, PGFUSE_STRICTATIME ),
 	FUSE_OPT_KEY( 	"-h",		KEY_HELP ),
 	FUSE_OPT_KEY( 	"--help",	KEY_HELP ),
 	FUSE_OPT_KEY( 	"-v",		KEY_VERBOSE ),
@@ -1605,6 +1817,37 @@ static void print_usage( char* progname )
 		"PgFuse options:\n"
 		"    ro                     mount filesystem read-only, do not change data in database\n"
 		"    blocksize=<bytes>      block size to use for storage of data\n"
+		"    dentry_cache_size=<n>  number of cached name lookups (0 disables the cache)\n"
+		"    dentry_cache_ttl=<s>   seconds a cached name lookup is valid\n"
+		"    negative_cache_size=<n> number of cached non-existing names (0 disables the cache)\n"
+		"    negative_cache_ttl=<s> seconds a name is known not to exist (also for the kernel)\n"
+		"    attr_cache_size=<n>    number of cached inode attributes (0 disables the cache)\n"
+		"    attr_cache_ttl=<s>     seconds cached inode attributes are valid\n"
+		"    write_buffer_size=<bytes> small writes gathered per open file (0 disables it)\n"
+		"    write_buffer_age=<s>   seconds after which gathered writes are written\n"
+		"    read_ahead_size=<bytes> maximal read-ahead for sequential reads (0 disables it)\n"
+		"    max_request_size=<bytes> maximal read and write requests of the kernel\n"
+		"                           (0 keeps the FUSE defaults)\n"
+		"    block_cache_size=<n>   number of cached data blocks (0 disables the cache)\n"
+		"    block_cache_ttl=<s>    seconds a cached data block is valid\n"
+		"    meta_flush_interval=<s> seconds file sizes and times are written in the\n"
+		"                           background (0 writes them immediately)\n"
+		"    pool_min=<n>           database connections kept open (multi-threaded)\n"
+		"    pool_max=<n>           maximum number of database connections (multi-threaded)\n"
+		"    replica=<conninfo>     hot standby serving reads\n"
+		"    replica_max_lag=<bytes> WAL the standby may lag behind to serve reads\n"
+		"    replica_poll_interval=<s> seconds between two checks of the standby\n"
+		"    kernel_attr_ttl=<s>    seconds the kernel caches attributes (default attr_cache_ttl)\n"
+		"    kernel_entry_ttl=<s>   seconds the kernel caches names (default dentry_cache_ttl)\n"
+		"    kernel_cache           the kernel keeps cached file data when a file is opened\n"
+		"    auto_cache             like kernel_cache if size and mtime didn't change\n"
+		"    notify                 drop cached data changed by other mounts (default)\n"
+		"    nonotify               don't listen for changes of other mounts\n"
+		"    lowlevel               use the inode based FUSE API (no path resolution)\n"
+		"    noatime                reads don't update the access time (default)\n"
+		"    relatime               reads update the access time if older than the modification\n"
+		"                           time or older than a day\n"
+		"    strictatime            every read updates the access time\n"
 		"\n",
 		progname
 	);
@@ -1624,6 +1867,26 @@ int main( int argc, char *argv[] )
 	memset( &pgfuse, 0, sizeof( pgfuse ) );
 	pgfuse.multi_threaded = 1;
 	pgfuse.block_size = DEFAULT_BLOCK_SIZE;
+	pgfuse.dentry_cache_size = DEFAULT_DENTRY_CACHE_SIZE;
+	pgfuse.dentry_cache_ttl = DEFAULT_DENTRY_CACHE_TTL;
+	pgfuse.negative_cache_size = DEFAULT_NEGATIVE_CACHE_SIZE;
+	pgfuse.negative_cache_ttl = DEFAULT_NEGATIVE_CACHE_TTL;
+	pgfuse.attr_cache_size = DEFAULT_ATTR_CACHE_SIZE;
+	pgfuse.attr_cache_ttl = DEFAULT_ATTR_CACHE_TTL;
+	pgfuse.write_buffer_size = DEFAULT_WRITE_BUFFER_SIZE;
+	pgfuse.write_buffer_age = DEFAULT_WRITE_BUFFER_AGE;
+	pgfuse.read_ahead_size = DEFAULT_READ_AHEAD_SIZE;
+	pgfuse.max_request_size = DEFAULT_MAX_REQUEST_SIZE;
+	pgfuse.block_cache_size = DEFAULT_BLOCK_CACHE_SIZE;
+	pgfuse.block_cache_ttl = DEFAULT_BLOCK_CACHE_TTL;
+	pgfuse.meta_flush_interval = DEFAULT_META_FLUSH_INTERVAL;
+	pgfuse.pool_min = DEFAULT_POOL_MIN;
+	pgfuse.pool_max = DEFAULT_POOL_MAX;
+	pgfuse.replica_max_lag = DEFAULT_REPLICA_MAX_LAG;
+	pgfuse.replica_poll_interval = DEFAULT_REPLICA_POLL_INTERVAL;
+	pgfuse.kernel_attr_ttl = -1;
+	pgfuse.kernel_entry_ttl = -1;
+	pgfuse.notify = 1;
 	
 	if( fuse_opt_parse( &args, &pgfuse, pgfuse_opts, pgfuse_opt_proc ) == -1 ) {
 		if( pgfuse.print_help ) {
@@ -1649,6 +1912,24 @@ int main( int argc, char *argv[] )
 		fprintf( stderr, "See '%s -h' for usage\n", basename( argv[0] ) );
 		exit( EXIT_FAILURE );
 	}
+	
+	if( pgfuse.pool_max == 0 || pgfuse.pool_min > pgfuse.pool_max ) {
+		fprintf( stderr, "Illegal pool size, expecting 0 <= pool_min <= pool_max and pool_max > 0\n" );
+		exit( EXIT_FAILURE );
+	}
+	
+	if( pgfuse.replica_conninfo != NULL && pgfuse.replica_poll_interval <= 0 ) {
+		fprintf( stderr, "Illegal replica_poll_interval, expecting a positive number of seconds\n" );
+		exit( EXIT_FAILURE );
+	}
+	
+	/* the path based frontend can't drop the file data the kernel keeps
+	 * over an open when another mount changes it */
+	if( !pgfuse.lowlevel && pgfuse.notify && ( pgfuse.kernel_cache || pgfuse.auto_cache ) ) {
+		fprintf( stderr, "kernel_cache and auto_cache can't be combined with notify without lowlevel, "
+			"use lowlevel or nonotify\n" );
+		exit( EXIT_FAILURE );
+	}
 		
 	/* just test if the connection can be established, do the
 	 * real connection in the fuse init function!
@@ -1682,6 +1963,16 @@ int main( int argc, char *argv[] )
 	}
 
 	openlog( basename( argv[0] ), LOG_PID, LOG_USER );	
+	
+	/* notifications only reach the caches of pgfuse, not the ones of
+	 * the kernel, unless the low-level frontend is used */
+	if( !pgfuse.lowlevel && pgfuse.notify && ( pgfuse.kernel_attr_ttl > 0 || pgfuse.kernel_entry_ttl > 0 ) ) {
+		fprintf( stderr, "Warning: without lowlevel the kernel keeps attributes and names changed by other mounts "
+			"for up to kernel_attr_ttl/kernel_entry_ttl seconds, notify doesn't drop them\n" );
+		syslog( LOG_WARNING, "Without lowlevel the kernel keeps attributes (%g s) and names (%g s) changed by other mounts, notify doesn't drop them",
+			( pgfuse.kernel_attr_ttl >= 0 ) ? pgfuse.kernel_attr_ttl : 0.0,
+			( pgfuse.kernel_entry_ttl >= 0 ) ? pgfuse.kernel_entry_ttl : 0.0 );
+	}
 		
 	/* Compare blocksize given as parameter and blocksize in database */
 	res = psql_get_block_size( conn, pgfuse.block_size );
@@ -1705,8 +1996,94 @@ int main( int argc, char *argv[] )
 	userdata.read_only = pgfuse.read_only;
 	userdata.multi_threaded = pgfuse.multi_threaded;
 	userdata.block_size = pgfuse.block_size;
+	userdata.dentry_cache_size = pgfuse.dentry_cache_size;
+	userdata.dentry_cache_ttl = pgfuse.dentry_cache_ttl;
+	userdata.negative_cache_size = pgfuse.negative_cache_size;
+	userdata.negative_cache_ttl = pgfuse.negative_cache_ttl;
+	userdata.attr_cache_size = pgfuse.attr_cache_size;
+	userdata.attr_cache_ttl = pgfuse.attr_cache_ttl;
+	userdata.write_buffer_size = pgfuse.write_buffer_size;
+	userdata.write_buffer_age = pgfuse.write_buffer_age;
+	userdata.read_ahead_size = pgfuse.read_ahead_size;
+	userdata.atime = pgfuse.atime;
+	userdata.block_cache_size = pgfuse.block_cache_size;
+	userdata.block_cache_ttl = pgfuse.block_cache_ttl;
+	userdata.meta_flush_interval = pgfuse.meta_flush_interval;
+	userdata.pool_min = pgfuse.pool_min;
+	userdata.pool_max = pgfuse.pool_max;
+	userdata.replica_conninfo = pgfuse.replica_conninfo;
+	userdata.replica_max_lag = pgfuse.replica_max_lag;
+	userdata.replica_poll_interval = pgfuse.replica_poll_interval;
+	userdata.kernel_attr_ttl = ( pgfuse.kernel_attr_ttl >= 0 ) ? pgfuse.kernel_attr_ttl : pgfuse.attr_cache_ttl;
+	userdata.kernel_entry_ttl = ( pgfuse.kernel_entry_ttl >= 0 ) ? pgfuse.kernel_entry_ttl : pgfuse.dentry_cache_ttl;
+	userdata.kernel_cache = pgfuse.kernel_cache;
+	userdata.auto_cache = pgfuse.auto_cache;
+	userdata.notify = pgfuse.notify;
+	
+	/* let the kernel cache non-existing names as long as we do, an
+	 * explicit negative_timeout given by the user comes later and wins
+	 * (the low-level frontend replies with the timeouts directly)
+	 */
+	if( !pgfuse.lowlevel && pgfuse.negative_cache_size > 0 && pgfuse.negative_cache_ttl > 0 ) {
+		char opt[64];
+		
+		snprintf( opt, sizeof( opt ), "-onegative_timeout=%g", pgfuse.negative_cache_ttl );
+		if( fuse_opt_insert_arg( &args, 1, opt ) < 0 ) {
+			fprintf( stderr, "Out of memory while setting negative_timeout\n" );
+			exit( EXIT_FAILURE );
+		}
+	}
 	
-	res = fuse_main( args.argc, args.argv, &pgfuse_oper, &userdata );
+	/* ask the kernel for large read and write requests instead of
+	 * single pages, explicit values given by the user come later and win
+	 */
+	if( pgfuse.max_request_size > 0 ) {
+		char opt[64];
+		int ok = 1;
+		
+		snprintf( opt, sizeof( opt ), "-omax_readahead=%u", pgfuse.max_request_size );
+		ok = ok && fuse_opt_insert_arg( &args, 1, opt ) == 0;
+		snprintf( opt, sizeof( opt ), "-omax_read=%u", pgfuse.max_request_size );
+		ok = ok && fuse_opt_insert_arg( &args, 1, opt ) == 0;
+		snprintf( opt, sizeof( opt ), "-omax_write=%u", pgfuse.max_request_size );
+		ok = ok && fuse_opt_insert_arg( &args, 1, opt ) == 0;
+		ok = ok && fuse_opt_insert_arg( &args, 1, "-obig_writes" ) == 0;
+		if( !ok ) {
+			fprintf( stderr, "Out of memory while setting the request sizes\n" );
+			exit( EXIT_FAILURE );
+		}
+	}
+	
+	/* the path based frontend leaves the kernel caching to FUSE */
+	if( !pgfuse.lowlevel ) {
+		char opt[64];
+		int ok = 1;
+		
+		if( pgfuse.kernel_attr_ttl >= 0 ) {
+			snprintf( opt, sizeof( opt ), "-oattr_timeout=%g", pgfuse.kernel_attr_ttl );
+			ok = ok && fuse_opt_add_arg( &args, opt ) == 0;
+		}
+		if( pgfuse.kernel_entry_ttl >= 0 ) {
+			snprintf( opt, sizeof( opt ), "-oentry_timeout=%g", pgfuse.kernel_entry_ttl );
+			ok = ok && fuse_opt_add_arg( &args, opt ) == 0;
+		}
+		if( pgfuse.kernel_cache ) {
+			ok = ok && fuse_opt_add_arg( &args, "-okernel_cache" ) == 0;
+		}
+		if( pgfuse.auto_cache ) {
+			ok = ok && fuse_opt_add_arg( &args, "-oauto_cache" ) == 0;
+		}
+		if( !ok ) {
+			fprintf( stderr, "Out of memory while setting the kernel cache options\n" );
+			exit( EXIT_FAILURE );
+		}
+	}
+	
+	if( pgfuse.lowlevel ) {
+		res = pgfuse_lowlevel_main( &args, &userdata );
+	} else {
+		res = fuse_main( args.argc, args.argv, &pgfuse_oper, &userdata );
+	}
 	
 	closelog( );
 	
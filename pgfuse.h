@@ -0,0 +1,130 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PGFUSE_H
+#define PGFUSE_H
+
+#include <sys/types.h>		/* size_t */
+#include <sys/time.h>		/* for struct timespec */
+#include <sys/statvfs.h>	/* for struct statvfs */
+
+#include <pthread.h>		/* for pthread_self */
+
+#include <fuse_opt.h>		/* for struct fuse_args */
+
+#include <libpq-fe.h>		/* for Postgresql database access */
+
+#include "pool.h"		/* implements the connection pool */
+#include "cache.h"		/* implements the metadata caches */
+#include "flusher.h"		/* implements the metadata flusher */
+#include "replica.h"		/* implements the read replica */
+#include "listener.h"		/* implements the change listener */
+
+/* --- private context data shared by the FUSE frontends --- */
+
+/* when reads update the access time of a file */
+enum {
+	PGFUSE_NOATIME = 0,	/* never */
+	PGFUSE_RELATIME,	/* if older than mtime/ctime or older than a day */
+	PGFUSE_STRICTATIME	/* always */
+};
+
+typedef struct PgFuseData {
+	int verbose;		/* whether we should be verbose */
+	char *conninfo;		/* connection info as used in PQconnectdb */
+	char *mountpoint;	/* where we mount the virtual filesystem */
+	PGconn *conn;		/* the database handle to operate on (single-thread only) */
+	PgConnPool pool;	/* the database pool to operate on (multi-thread only) */
+	int read_only;		/* whether the mount point is read-only */
+	int multi_threaded;	/* whether we run multi-threaded */
+	size_t block_size;	/* block size to use for storage of data in bytea fields */
+	size_t dentry_cache_size; /* number of entries in the dentry cache, 0 disables it */
+	double dentry_cache_ttl;  /* seconds a cached dentry is valid */
+	PgDentryCache dentry_cache; /* cache of (parent_id, name) -> id lookups */
+	size_t negative_cache_size; /* number of entries in the negative cache, 0 disables it */
+	double negative_cache_ttl;  /* seconds a name is known not to exist */
+	PgDentryCache negative_cache; /* cache of names known not to exist */
+	size_t attr_cache_size;	/* number of entries in the attribute cache, 0 disables it */
+	double attr_cache_ttl;	/* seconds cached metadata of an inode is valid */
+	PgMetaCache attr_cache;	/* cache of id -> metadata */
+	size_t write_buffer_size; /* bytes of small writes gathered per open file, 0 disables it */
+	double write_buffer_age; /* seconds after which buffered writes are written out */
+	size_t read_ahead_size;	/* maximal bytes read ahead for sequential reads, 0 disables it */
+	int atime;		/* atime policy, PGFUSE_NOATIME and friends */
+	size_t block_cache_size; /* number of data blocks in the block cache, 0 disables it */
+	double block_cache_ttl;	/* seconds a cached data block is valid */
+	PgBlockCache block_cache; /* cache of (dir_id, block_no) -> data */
+	double meta_flush_interval; /* seconds between writes of lazy metadata, 0 disables it */
+	PgMetaFlusher flusher;	/* thread writing the lazy metadata */
+	size_t pool_min;	/* number of connections kept open in the pool */
+	size_t pool_max;	/* maximum number of connections in the pool */
+	char *replica_conninfo;	/* connection info of a hot standby for reads, NULL for none */
+	size_t replica_max_lag;	/* bytes of WAL the standby may lag behind */
+	double replica_poll_interval; /* seconds between two checks of the standby */
+	PgReplica replica;	/* connections to the standby */
+	double kernel_attr_ttl;	/* seconds the kernel caches attributes (low-level frontend) */
+	double kernel_entry_ttl; /* seconds the kernel caches names (low-level frontend) */
+	int kernel_cache;	/* the kernel keeps cached file data over an open */
+	int auto_cache;		/* like kernel_cache if size and mtime didn't change */
+	int notify;		/* whether to listen for changes of other mounts */
+	PgListener listener;	/* thread invalidating caches on changes of other mounts */
+} PgFuseData;
+
+/* connect to the database and set up the caches, exits on failure */
+void pgfuse_setup( PgFuseData *data );
+
+void pgfuse_teardown( PgFuseData *data );
+
+/* --- helpers shared by the FUSE frontends --- */
+
+struct timespec pgfuse_now( void );
+
+PGconn *psql_acquire( PgFuseData *data );
+
+int psql_release( PgFuseData *data, PGconn *conn );
+
+/* a connection to the replica if it is usable, for operations which
+ * only read, otherwise a connection to the primary */
+PGconn *psql_acquire_read( PgFuseData *data );
+
+#define ACQUIRE( C ) \
+	C = psql_acquire( data ); \
+	if( C == NULL ) return -EIO;
+
+#define ACQUIRE_READ( C ) \
+	C = psql_acquire_read( data ); \
+	if( C == NULL ) return -EIO;
+	
+#define RELEASE( C ) \
+	if( psql_release( data, C ) < 0 ) return -EIO;
+
+#define THREAD_ID (unsigned int)pthread_self( )
+
+int pgfuse_statfs_data( PgFuseData *data, struct statvfs *buf );
+
+/* tell the kernel that its cached attributes and data of 'id' or the
+ * cached entry 'name' in directory 'parent_id' are stale, sent in the
+ * background, does nothing with the path based frontend */
+void pgfuse_invalidate_inode( PgFuseData *data, const int64_t id );
+
+void pgfuse_invalidate_entry( PgFuseData *data, const int64_t parent_id, const char *name );
+
+/* --- the low-level (inode based) frontend --- */
+
+int pgfuse_lowlevel_main( struct fuse_args *args, PgFuseData *data );
+
+#endif
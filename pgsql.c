@@ -17,8 +17,10 @@
 
 #include "pgsql.h"
 
-#include <string.h>		/* for strlen, memcpy, strcmp, strtok_r */
+#include <string.h>		/* for strlen, memcpy, strcmp, strtok_r, memset */
 #include <stdlib.h>		/* for atoi */
+#include <stdio.h>		/* for snprintf */
+#include <unistd.h>		/* for gethostname, getpid */
 
 #include <syslog.h>		/* for ERR_XXX */
 #include <errno.h>		/* for ENOENT and friends */
@@ -26,10 +28,13 @@
 #include <stdint.h>		/* for uint64_t */
 #include <inttypes.h>		/* for PRIxxx macros */
 #include <values.h>		/* for INT_MAX */
+#include <pthread.h>		/* for thread-specific data */
 
 #include "endian.h"		/* for be64toh and htobe64 */
 
 #include "config.h"		/* compiled in defaults */
+#include "cache.h"		/* for the metadata caches */
+#include "statements.h"	/* SQL of the hot statements */
 
 /* --- helper functions --- */
 
@@ -92,70 +97,1109 @@ static PgDataInfo compute_block_info( size_t block_size, off_t offset, size_t le
 	return info;
 }
 
-int64_t psql_path_to_id( PGconn *conn, const char *path )
+/* a range spanning several blocks: an optional partial first block,
+ * the full blocks in the middle and an optional partial last block */
+typedef struct PgBlockSpan {
+	int head;		/* the first block is covered partially */
+	int tail;		/* the last block is covered partially */
+	int64_t first_full;	/* number of the first full block */
+	size_t nof_full;	/* number of full blocks */
+} PgBlockSpan;
+
+static PgBlockSpan compute_block_span( const size_t block_size, PgDataInfo info )
+{
+	PgBlockSpan span;
+	
+	span.head = ( info.from_offset != 0 || info.from_len != block_size );
+	span.tail = ( info.to_len != block_size );
+	span.first_full = info.from_block + ( span.head ? 1 : 0 );
+	span.nof_full = info.to_block - span.first_full + ( span.tail ? 0 : 1 );
+	
+	return span;
+}
+
+/* decode a row of dir columns (size, mode, uid, gid, ctime, mtime, atime, parent_id) */
+static void get_meta_from_result( PGresult *res, int row, PgMeta *meta )
+{
+	int idx;
+	char *data;
+	
+	idx = PQfnumber( res, "size" );
+	data = PQgetvalue( res, row, idx );
+	meta->size = be64toh( *( (int64_t *)data ) );
+	
+	idx = PQfnumber( res, "mode" );
+	data = PQgetvalue( res, row, idx );
+	meta->mode = ntohl( *( (uint32_t *)data ) );
+
+	idx = PQfnumber( res, "uid" );
+	data = PQgetvalue( res, row, idx );
+	meta->uid = ntohl( *( (uint32_t *)data ) );
+
+	idx = PQfnumber( res, "gid" );
+	data = PQgetvalue( res, row, idx );
+	meta->gid = ntohl( *( (uint32_t *)data ) );
+	
+	idx = PQfnumber( res, "ctime" );
+	data = PQgetvalue( res, row, idx );
+	meta->ctime = convert_from_timestamp( *( (uint64_t *)data ) );
+
+	idx = PQfnumber( res, "mtime" );
+	data = PQgetvalue( res, row, idx );
+	meta->mtime = convert_from_timestamp( *( (uint64_t *)data ) );
+
+	idx = PQfnumber( res, "atime" );
+	data = PQgetvalue( res, row, idx );
+	meta->atime = convert_from_timestamp( *( (uint64_t *)data ) );
+
+	idx = PQfnumber( res, "parent_id" );
+	data = PQgetvalue( res, row, idx );
+	meta->parent_id = be64toh( *( (int64_t *)data ) );
+}
+
+/* split a path into its components, the components point into
+ * the returned copy of the path (which must be freed by the caller)
+ */
+static char *split_path( const char *path, char ***parts, int *nof_parts )
+{
+	char *copy_path;
+	char *name;
+	char *ptr = NULL;
+	
+	copy_path = strdup( path );
+	if( copy_path == NULL ) {
+		return NULL;
+	}
+	
+	/* there can't be more components than half the characters */
+	*parts = (char **)malloc( ( strlen( path ) / 2 + 1 ) * sizeof( char * ) );
+	if( *parts == NULL ) {
+		free( copy_path );
+		return NULL;
+	}
+	
+	*nof_parts = 0;
+	for( name = strtok_r( copy_path, "/", &ptr ); name != NULL; name = strtok_r( NULL, "/", &ptr ) ) {
+		(*parts)[(*nof_parts)++] = name;
+	}
+	
+	return copy_path;
+}
+
+/* return path components as a text[] literal (e.g. '{"a","b"}'),
+ * quoting double quotes and backslashes
+ */
+static char *parts_to_array( char **parts, const int nof_parts )
+{
+	char *array;
+	char *dst;
+	const char *src;
+	size_t len;
+	int i;
+	
+	len = 3;
+	for( i = 0; i < nof_parts; i++ ) {
+		len += 2 * strlen( parts[i] ) + 3;
+	}
+	
+	array = (char *)malloc( len );
+	if( array == NULL ) {
+		return NULL;
+	}
+	
+	dst = array;
+	*dst++ = '{';
+	for( i = 0; i < nof_parts; i++ ) {
+		if( i > 0 ) {
+			*dst++ = ',';
+		}
+		*dst++ = '"';
+		for( src = parts[i]; *src != '\0'; src++ ) {
+			if( *src == '"' || *src == '\\' ) {
+				*dst++ = '\\';
+			}
+			*dst++ = *src;
+		}
+		*dst++ = '"';
+	}
+	*dst++ = '}';
+	*dst = '\0';
+	
+	return array;
+}
+
+/* the last component of a path, this is the name in dir */
+static const char *last_component( const char *path )
+{
+	const char *name = strrchr( path, '/' );
+	
+	return ( name == NULL ) ? path : name + 1;
+}
+
+/* --- caches --- */
+
+static PgDentryCache *dentry_cache = NULL;
+static PgDentryCache *negative_cache = NULL;
+static PgMetaCache *meta_cache = NULL;
+static PgBlockCache *block_cache = NULL;
+
+void psql_set_dentry_cache( PgDentryCache *cache )
+{
+	dentry_cache = cache;
+}
+
+void psql_set_negative_cache( PgDentryCache *cache )
+{
+	negative_cache = cache;
+}
+
+void psql_set_meta_cache( PgMetaCache *cache )
+{
+	meta_cache = cache;
+}
+
+void psql_set_block_cache( PgBlockCache *cache )
+{
+	block_cache = cache;
+}
+
+/* a transaction which changed the filesystem may have left uncommitted
+ * state in the caches, we have to forget about them if it doesn't commit
+ */
+static pthread_key_t tx_dirty_key;
+static pthread_once_t tx_dirty_once = PTHREAD_ONCE_INIT;
+
+/* value of tx_dirty_key of a transaction which changed data blocks */
+#define TX_BLOCKS	((void *)2)
+
+/* number of open transactions which changed data blocks, blocks read
+ * from the database meanwhile don't go to the block cache */
+static int block_writers = 0;
+
+static void tx_dirty_init( void )
+{
+	(void)pthread_key_create( &tx_dirty_key, NULL );
+}
+
+static void tx_set_dirty( int dirty )
+{
+	void *cur;
+	
+	(void)pthread_once( &tx_dirty_once, tx_dirty_init );
+	cur = pthread_getspecific( tx_dirty_key );
+	
+	if( dirty ) {
+		if( cur == NULL ) (void)pthread_setspecific( tx_dirty_key, (void *)1 );
+		return;
+	}
+	
+	/* blocks read during the transaction may be older than its writes */
+	if( cur == TX_BLOCKS ) {
+		if( block_cache != NULL ) psql_block_cache_bump( block_cache );
+		(void)__sync_sub_and_fetch( &block_writers, 1 );
+	}
+	(void)pthread_setspecific( tx_dirty_key, NULL );
+}
+
+/* to be called before the block cache is changed for a write */
+static void tx_set_block_writer( void )
+{
+	(void)pthread_once( &tx_dirty_once, tx_dirty_init );
+	if( pthread_getspecific( tx_dirty_key ) != TX_BLOCKS ) {
+		(void)__sync_add_and_fetch( &block_writers, 1 );
+		(void)pthread_setspecific( tx_dirty_key, TX_BLOCKS );
+	}
+}
+
+static int tx_is_dirty( void )
+{
+	(void)pthread_once( &tx_dirty_once, tx_dirty_init );
+	return pthread_getspecific( tx_dirty_key ) != NULL;
+}
+
+/* transactions are started lazily before the first statement changing
+ * the filesystem, until then statements run in autocommit mode, so pure
+ * read operations don't pay for the BEGIN/COMMIT round trips
+ */
+static int begin_write( PGconn *conn )
+{
+	PGresult *res;
+	
+	if( PQtransactionStatus( conn ) != PQTRANS_IDLE ) {
+		return 0;
+	}
+	
+	res = PQexec( conn, "BEGIN" );
+	
+	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
+		syslog( LOG_ERR, "Begin of transaction failed: %s", PQerrorMessage( conn ) );
+		PQclear( res );
+		return -EIO;
+	}
+	
+	PQclear( res );
+	
+	return 0;
+}
+
+#define BEGIN_WRITE( C ) \
+	{ \
+		int __res; \
+		__res = begin_write( C ); \
+		if( __res < 0 ) return __res; \
+	}
+
+/* keys of the dentry, negative and attribute caches changed by the
+ * current transaction, they are removed again after the COMMIT, as a
+ * concurrent lookup may have put the old state back in the meantime.
+ * Attributes written by the transaction go to the cache only then.
+ */
+typedef struct PgTouched {
+	int64_t parent_id;	/* directory of the entry 'name' */
+	char *name;		/* name of the entry, NULL for the attributes of 'id' */
+	int64_t id;		/* id/inode_no whose attributes changed */
+	int has_meta;		/* 'meta' holds the new attributes */
+	PgMeta meta;		/* attributes written by the transaction */
+	struct PgTouched *next;
+} PgTouched;
+
+static pthread_key_t touched_key;
+static pthread_once_t touched_once = PTHREAD_ONCE_INIT;
+
+/* a key got lost for lack of memory, all caches are flushed on commit */
+static int touched_lost = 0;
+
+/* lookups fill the caches only if no transaction committed and no
+ * other mount reported a change since they took the generation before
+ * their query, the check and the insert are done under the read lock */
+static uint64_t fill_generation = 0;
+static pthread_rwlock_t fill_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void touched_init( void )
+{
+	(void)pthread_key_create( &touched_key, NULL );
+}
+
+static PgTouched *touch( const int64_t parent_id, const char *name, const int64_t id )
+{
+	PgTouched *t;
+	
+	(void)pthread_once( &touched_once, touched_init );
+	
+	for( t = (PgTouched *)pthread_getspecific( touched_key ); t != NULL; t = t->next ) {
+		if( name == NULL && t->name == NULL && t->id == id ) return t;
+		if( name != NULL && t->name != NULL && t->parent_id == parent_id && strcmp( t->name, name ) == 0 ) return t;
+	}
+	
+	t = (PgTouched *)malloc( sizeof( PgTouched ) );
+	if( t != NULL && name != NULL ) {
+		t->name = strdup( name );
+		if( t->name == NULL ) {
+			free( t );
+			t = NULL;
+		}
+	} else if( t != NULL ) {
+		t->name = NULL;
+	}
+	if( t == NULL ) {
+		(void)__sync_lock_test_and_set( &touched_lost, 1 );
+		return NULL;
+	}
+	
+	t->parent_id = parent_id;
+	t->id = id;
+	t->has_meta = 0;
+	t->next = (PgTouched *)pthread_getspecific( touched_key );
+	(void)pthread_setspecific( touched_key, t );
+	
+	return t;
+}
+
+/* the attributes of 'id' change, 'meta' (if not NULL) is the new value
+ * for the cache after the commit */
+static void touch_meta( const int64_t id, const PgMeta *meta )
+{
+	PgTouched *t;
+	
+	tx_set_dirty( 1 );
+	
+	t = touch( 0, NULL, id );
+	if( t == NULL ) return;
+	
+	t->has_meta = ( meta != NULL );
+	if( meta != NULL ) t->meta = *meta;
+}
+
+/* the current transaction changed the entry 'name' in 'parent_id', the
+ * shared caches may still hold the committed state for it */
+static int touched_dentry( const int64_t parent_id, const char *name )
+{
+	PgTouched *t;
+	
+	if( !tx_is_dirty( ) ) return 0;
+	if( __sync_add_and_fetch( &touched_lost, 0 ) ) return 1;
+	
+	(void)pthread_once( &touched_once, touched_init );
+	for( t = (PgTouched *)pthread_getspecific( touched_key ); t != NULL; t = t->next ) {
+		if( t->name != NULL && t->parent_id == parent_id && strcmp( t->name, name ) == 0 ) return 1;
+	}
+	
+	return 0;
+}
+
+/* the current transaction changed the attributes of 'id', returns 1 and
+ * the new attributes in 'meta' if they are known, -1 if not */
+static int touched_meta( const int64_t id, PgMeta *meta )
+{
+	PgTouched *t;
+	
+	if( !tx_is_dirty( ) ) return 0;
+	
+	(void)pthread_once( &touched_once, touched_init );
+	for( t = (PgTouched *)pthread_getspecific( touched_key ); t != NULL; t = t->next ) {
+		if( t->name == NULL && t->id == id ) {
+			if( !t->has_meta ) return -1;
+			*meta = t->meta;
+			return 1;
+		}
+	}
+	
+	if( __sync_add_and_fetch( &touched_lost, 0 ) ) return -1;
+	
+	return 0;
+}
+
+/* lookups which took the generation before this call don't fill the
+ * caches anymore, once the write lock is taken no insert is in flight */
+static void fill_bump( void )
+{
+	(void)pthread_rwlock_wrlock( &fill_lock );
+	fill_generation++;
+	(void)pthread_rwlock_unlock( &fill_lock );
+}
+
+static uint64_t fill_begin( void )
+{
+	return __sync_add_and_fetch( &fill_generation, 0 );
+}
+
+/* lookups of a transaction with uncommitted changes don't go to the
+ * shared caches, the caller releases the lock after the insert */
+static int fill_lock_if( const uint64_t generation )
+{
+	if( tx_is_dirty( ) ) return 0;
+	
+	(void)pthread_rwlock_rdlock( &fill_lock );
+	if( fill_generation != generation ) {
+		(void)pthread_rwlock_unlock( &fill_lock );
+		return 0;
+	}
+	
+	return 1;
+}
+
+static void forget_dentry( const int64_t parent_id, const char *name )
+{
+	tx_set_dirty( 1 );
+	(void)touch( parent_id, name, 0 );
+	
+	if( dentry_cache != NULL ) {
+		psql_dentry_cache_remove( dentry_cache, parent_id, name );
+	}
+	
+	if( negative_cache != NULL ) {
+		psql_dentry_cache_remove( negative_cache, parent_id, name );
+	}
+}
+
+static void remember_dentry( const int64_t parent_id, const char *name, const int64_t id, const mode_t mode, const uint64_t generation )
+{
+	if( dentry_cache != NULL && fill_lock_if( generation ) ) {
+		psql_dentry_cache_insert( dentry_cache, parent_id, name, id, mode );
+		(void)pthread_rwlock_unlock( &fill_lock );
+	}
+}
+
+/* remember that 'name' doesn't exist in directory 'parent_id' */
+static void remember_missing( const int64_t parent_id, const char *name, const uint64_t generation )
+{
+	if( negative_cache != NULL && fill_lock_if( generation ) ) {
+		psql_dentry_cache_insert( negative_cache, parent_id, name, -ENOENT, 0 );
+		(void)pthread_rwlock_unlock( &fill_lock );
+	}
+}
+
+static void remember_meta( const int64_t id, const PgMeta *meta, const uint64_t generation )
+{
+	if( meta_cache != NULL && fill_lock_if( generation ) ) {
+		psql_meta_cache_insert( meta_cache, id, meta );
+		(void)pthread_rwlock_unlock( &fill_lock );
+	}
+}
+
+static void forget_meta( const int64_t id )
+{
+	touch_meta( id, NULL );
+	
+	if( meta_cache != NULL ) {
+		psql_meta_cache_remove( meta_cache, id );
+	}
+}
+
+/* a block read from the database, 'generation' was taken before the
+ * query, a write in the meantime makes it possibly stale */
+static void remember_block( const int64_t id, const int64_t block_no, const char *data, const size_t len, const uint64_t generation )
+{
+	if( block_cache != NULL && __sync_add_and_fetch( &block_writers, 0 ) == 0 ) {
+		psql_block_cache_fill( block_cache, id, block_no, data, len, generation );
+	}
+}
+
+/* a completely written block is known, a partially written one is not */
+static void remember_block_write( const int64_t id, const int64_t block_no, const char *buf, const off_t offset, const size_t len, const size_t block_size )
+{
+	tx_set_block_writer( );
+	
+	if( block_cache == NULL ) {
+		return;
+	}
+	
+	if( offset == 0 && len == block_size ) {
+		psql_block_cache_insert( block_cache, id, block_no, buf, len );
+	} else {
+		psql_block_cache_remove( block_cache, id, block_no );
+	}
+}
+
+static void forget_blocks( const int64_t id, const int64_t from_block_no, const int64_t to_block_no )
+{
+	tx_set_block_writer( );
+	
+	if( block_cache != NULL && to_block_no >= from_block_no ) {
+		psql_block_cache_remove_range( block_cache, id, from_block_no, to_block_no );
+	}
+}
+
+/* forget the dentries returned by a 'DELETE .. RETURNING parent_id, name' */
+static void forget_deleted( PGresult *res )
+{
+	int i;
+	char *data;
+	int64_t parent_id;
+	
+	for( i = 0; i < PQntuples( res ); i++ ) {
+		data = PQgetvalue( res, i, 0 );
+		parent_id = be64toh( *( (int64_t *)data ) );
+		forget_dentry( parent_id, PQgetvalue( res, i, 1 ) );
+	}
+}
+
+static void flush_caches( void )
+{
+	fill_bump( );
+	
+	if( dentry_cache != NULL ) {
+		psql_dentry_cache_flush( dentry_cache );
+	}
+	
+	if( negative_cache != NULL ) {
+		psql_dentry_cache_flush( negative_cache );
+	}
+	
+	if( meta_cache != NULL ) {
+		psql_meta_cache_flush( meta_cache );
+	}
+	
+	if( block_cache != NULL ) {
+		psql_block_cache_flush( block_cache );
+	}
+}
+
+/* the transaction ended, after a commit the keys it touched are
+ * removed again and the attributes it wrote are cached */
+static void tx_end( int committed )
+{
+	PgTouched *t;
+	PgTouched *next;
+	
+	(void)pthread_once( &touched_once, touched_init );
+	t = (PgTouched *)pthread_getspecific( touched_key );
+	(void)pthread_setspecific( touched_key, NULL );
+	
+	if( committed && t != NULL ) {
+		(void)pthread_rwlock_wrlock( &fill_lock );
+		fill_generation++;
+		for( next = t; next != NULL; next = next->next ) {
+			if( next->name != NULL ) {
+				if( dentry_cache != NULL ) psql_dentry_cache_remove( dentry_cache, next->parent_id, next->name );
+				if( negative_cache != NULL ) psql_dentry_cache_remove( negative_cache, next->parent_id, next->name );
+			} else if( meta_cache != NULL ) {
+				if( next->has_meta ) {
+					psql_meta_cache_insert( meta_cache, next->id, &next->meta );
+				} else {
+					psql_meta_cache_remove( meta_cache, next->id );
+				}
+			}
+		}
+		(void)pthread_rwlock_unlock( &fill_lock );
+	}
+	
+	if( committed && __sync_lock_test_and_set( &touched_lost, 0 ) ) {
+		flush_caches( );
+	}
+	
+	for( ; t != NULL; t = next ) {
+		next = t->next;
+		free( t->name );
+		free( t );
+	}
+	
+	tx_set_dirty( 0 );
+}
+
+/* --- changes by other clients --- */
+
+void psql_invalidate_dir( const int64_t id, const int64_t parent_id, const char *name )
+{
+	fill_bump( );
+	
+	if( meta_cache != NULL ) {
+		psql_meta_cache_remove( meta_cache, id );
+	}
+	
+	if( dentry_cache != NULL ) {
+		psql_dentry_cache_remove( dentry_cache, parent_id, name );
+	}
+	
+	if( negative_cache != NULL ) {
+		psql_dentry_cache_remove( negative_cache, parent_id, name );
+	}
+}
+
+void psql_invalidate_data( const int64_t id )
+{
+	if( block_cache != NULL ) {
+		psql_block_cache_remove_range( block_cache, id, 0, INT64_MAX );
+	}
+}
+
+void psql_invalidate_all( void )
+{
+	flush_caches( );
+}
+
+/* identifies the changes of this mount in the notifications, so they
+ * don't invalidate our own caches */
+static char client_id[64] = "";
+static pthread_once_t client_id_once = PTHREAD_ONCE_INIT;
+
+static void client_id_init( void )
+{
+	char host[32];
+	
+	if( gethostname( host, sizeof( host ) ) != 0 ) {
+		strcpy( host, "localhost" );
+	}
+	host[sizeof( host ) - 1] = '\0';
+	
+	snprintf( client_id, sizeof( client_id ), "%s:%d", host, (int)getpid( ) );
+}
+
+const char *psql_client_id( void )
+{
+	(void)pthread_once( &client_id_once, client_id_init );
+	
+	return client_id;
+}
+
+int psql_set_client( PGconn *conn )
+{
+	const char *values[1] = { psql_client_id( ) };
+	PGresult *res;
+	
+	res = PQexecParams( conn, "SELECT set_config( 'pgfuse.client', $1::text, false )", 1, NULL, values, NULL, NULL, 0 );
+	if( PQresultStatus( res ) != PGRES_TUPLES_OK ) {
+		syslog( LOG_ERR, "Error setting the client id: %s", PQerrorMessage( conn ) );
+		PQclear( res );
+		return -EIO;
+	}
+	
+	PQclear( res );
+	
+	return 0;
+}
+
+/* --- lazily written metadata --- */
+
+/* size, mtime and atime changed by reads and writes are collected here
+ * and written by psql_flush_dirty_meta in one statement for many files.
+ * Changes of a transaction are kept per thread and only become visible
+ * when it commits. An entry stays in the table while it is flushed and
+ * is only removed if its version didn't change in the meantime.
+ */
+typedef struct PgDirtyMeta {
+	int64_t id;
+	int64_t size;
+	struct timespec mtime;
+	struct timespec atime;
+	uint64_t version;	/* incremented on every change of the entry */
+	int written;		/* pending: already written by psql_write_meta */
+	uint64_t flushes;	/* pending: flushes started before that write */
+	struct PgDirtyMeta *next;
+} PgDirtyMeta;
+
+#define DIRTY_META_BUCKETS	1024
+
+/* number of files updated by one statement */
+#define DIRTY_META_BATCH	256
+
+static int lazy_meta = 0;
+static PgDirtyMeta *dirty_meta[DIRTY_META_BUCKETS];
+static pthread_mutex_t dirty_meta_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t pending_meta_key;
+static pthread_once_t pending_meta_once = PTHREAD_ONCE_INIT;
+
+/* number of started and finished flushes, protected by dirty_meta_lock */
+static uint64_t flushes_started = 0;
+static uint64_t flushes_finished = 0;
+
+static void pending_meta_init( void )
+{
+	(void)pthread_key_create( &pending_meta_key, NULL );
+}
+
+void psql_set_lazy_meta( int lazy )
+{
+	lazy_meta = lazy;
+}
+
+static PgDirtyMeta **dirty_meta_bucket( const int64_t id )
+{
+	return &dirty_meta[(uint64_t)id % DIRTY_META_BUCKETS];
+}
+
+/* merge a committed change into the table, caller holds the lock,
+ * returns the entry if it was not needed */
+static PgDirtyMeta *dirty_meta_merge( PgDirtyMeta *d )
+{
+	PgDirtyMeta **b = dirty_meta_bucket( d->id );
+	PgDirtyMeta *e;
+	
+	for( e = *b; e != NULL; e = e->next ) {
+		if( e->id == d->id ) {
+			e->size = d->size;
+			e->mtime = d->mtime;
+			e->atime = d->atime;
+			e->version++;
+			return d;
+		}
+	}
+	
+	/* already in the database, unless a flush running during the
+	 * write could have overwritten it with older values */
+	if( d->written && flushes_started == d->flushes && flushes_finished == d->flushes ) {
+		return d;
+	}
+	
+	d->version = 0;
+	d->next = *b;
+	*b = d;
+	
+	return NULL;
+}
+
+/* remove an entry after a flush, unless it changed in the meantime */
+static void dirty_meta_remove( const int64_t id, const uint64_t version )
+{
+	PgDirtyMeta **e;
+	PgDirtyMeta *d;
+	
+	for( e = dirty_meta_bucket( id ); *e != NULL; e = &(*e)->next ) {
+		if( (*e)->id == id ) {
+			if( (*e)->version == version ) {
+				d = *e;
+				*e = d->next;
+				free( d );
+			}
+			return;
+		}
+	}
+}
+
+/* remember a change of the current transaction */
+static int add_pending_meta( const int64_t id, const PgMeta *meta, const int written, const uint64_t flushes )
+{
+	PgDirtyMeta *d;
+	
+	(void)pthread_once( &pending_meta_once, pending_meta_init );
+	
+	/* a second change in the same transaction */
+	for( d = (PgDirtyMeta *)pthread_getspecific( pending_meta_key ); d != NULL; d = d->next ) {
+		if( d->id == id ) break;
+	}
+	
+	if( d == NULL ) {
+		d = (PgDirtyMeta *)malloc( sizeof( PgDirtyMeta ) );
+		if( d == NULL ) {
+			return -ENOMEM;
+		}
+		d->id = id;
+		d->written = written;
+		d->flushes = flushes;
+		d->next = (PgDirtyMeta *)pthread_getspecific( pending_meta_key );
+		(void)pthread_setspecific( pending_meta_key, d );
+	}
+	
+	/* a lazy change in the transaction still has to be flushed */
+	d->written = d->written && written;
+	d->size = meta->size;
+	d->mtime = meta->mtime;
+	d->atime = meta->atime;
+	
+	return 0;
+}
+
+/* the transaction committed, its changes get visible to the flusher */
+static void publish_pending_meta( void )
+{
+	PgDirtyMeta *d;
+	PgDirtyMeta *next;
+	
+	(void)pthread_once( &pending_meta_once, pending_meta_init );
+	d = (PgDirtyMeta *)pthread_getspecific( pending_meta_key );
+	if( d == NULL ) return;
+	(void)pthread_setspecific( pending_meta_key, NULL );
+	
+	(void)pthread_mutex_lock( &dirty_meta_lock );
+	for( ; d != NULL; d = next ) {
+		next = d->next;
+		free( dirty_meta_merge( d ) );
+	}
+	(void)pthread_mutex_unlock( &dirty_meta_lock );
+}
+
+static void discard_pending_meta( void )
+{
+	PgDirtyMeta *d;
+	PgDirtyMeta *next;
+	
+	(void)pthread_once( &pending_meta_once, pending_meta_init );
+	d = (PgDirtyMeta *)pthread_getspecific( pending_meta_key );
+	(void)pthread_setspecific( pending_meta_key, NULL );
+	
+	for( ; d != NULL; d = next ) {
+		next = d->next;
+		free( d );
+	}
+}
+
+/* the metadata of a file read from the database lacks the changes not
+ * written yet */
+static void apply_dirty_meta( const int64_t id, PgMeta *meta )
+{
+	PgDirtyMeta *e;
+	
+	if( !lazy_meta ) return;
+	
+	/* own changes of the current transaction come first */
+	(void)pthread_once( &pending_meta_once, pending_meta_init );
+	for( e = (PgDirtyMeta *)pthread_getspecific( pending_meta_key ); e != NULL; e = e->next ) {
+		if( e->id == id ) {
+			meta->size = e->size;
+			meta->mtime = e->mtime;
+			meta->atime = e->atime;
+			return;
+		}
+	}
+	
+	(void)pthread_mutex_lock( &dirty_meta_lock );
+	for( e = *dirty_meta_bucket( id ); e != NULL; e = e->next ) {
+		if( e->id == id ) {
+			meta->size = e->size;
+			meta->mtime = e->mtime;
+			meta->atime = e->atime;
+			break;
+		}
+	}
+	(void)pthread_mutex_unlock( &dirty_meta_lock );
+}
+
+/* --- committed writes --- */
+
+/* counts the committed write transactions, a replica has our writes if
+ * it replayed the WAL position of the primary read after the count was
+ * taken */
+static uint64_t write_seq = 0;
+
+/* --- connection loss --- */
+
+int psql_reconnect( PGconn *conn )
+{
+	PQreset( conn );
+	if( PQstatus( conn ) != CONNECTION_OK ) {
+		syslog( LOG_ERR, "Reconnecting to database failed: %s", PQerrorMessage( conn ) );
+		return -EIO;
+	}
+	
+	syslog( LOG_INFO, "Reconnected to database" );
+	
+	return psql_prepare_statements( conn );
+}
+
+/* runs a reading prepared statement, outside of a transaction it can be
+ * repeated once on a new connection if the connection got lost */
+static PGresult *exec_read( PGconn *conn, const char *name, int nof_params, const char * const *values, const int *lengths, const int *binary )
+{
+	PGresult *res;
+	int idle = ( PQtransactionStatus( conn ) == PQTRANS_IDLE );
+	
+	res = PQexecPrepared( conn, name, nof_params, values, lengths, binary, 1 );
+	
+	if( PQresultStatus( res ) == PGRES_TUPLES_OK || !idle ||
+		PQstatus( conn ) != CONNECTION_BAD ) {
+		return res;
+	}
+	
+	syslog( LOG_WARNING, "Lost connection to database in '%s', retrying", name );
+	
+	if( psql_reconnect( conn ) < 0 ) {
+		return res;
+	}
+	
+	PQclear( res );
+	
+	return PQexecPrepared( conn, name, nof_params, values, lengths, binary, 1 );
+}
+
+/* send a prepared statement whose rows are fetched one by one with
+ * PQgetResult, so the whole result is never held in memory */
+static int send_single_row( PGconn *conn, const char *name, int nof_params, const char * const *values, const int *lengths, const int *binary )
+{
+	if( !PQsendQueryPrepared( conn, name, nof_params, values, lengths, binary, 1 ) ) {
+		syslog( LOG_ERR, "Error sending '%s': %s", name, PQerrorMessage( conn ) );
+		return -EIO;
+	}
+	
+	/* can't fail directly after sending the query */
+	(void)PQsetSingleRowMode( conn );
+	
+	return 0;
+}
+
+/* resolve path components in one round trip: the recursive CTE descends
+ * from the directory with id 'start_id' one component per level, as long
+ * as the current inode is a directory (61440 = S_IFMT, 16384 = S_IFDIR).
+ * Returns the id of the deepest inode reached and the number of
+ * components resolved in 'depth'. All intermediate entries are added
+ * to the dentry cache.
+ */
+static int64_t psql_walk_path( PGconn *conn, const char *path, const int64_t start_id, char **parts, const int nof_parts, int *depth, PgMeta *meta, const uint64_t generation )
 {
 	PGresult *res;
+	char *array;
+	int param2 = htonl( nof_parts );
+	int64_t param3 = htobe64( start_id );
+	const char *values[3];
+	int lengths[3];
+	int binary[3] = { 0, 1, 1 };
 	int idx;
 	char *data;
-	int64_t id = htobe64( 0 );
-	char *name;
-	const char *values[2] = { NULL, (const char *)&id };
-	int lengths[2] = { 0, sizeof( id ) };
-	int binary[2] = { 0, 1 };
+	int i;
+	int64_t id = start_id;
+	
+	array = parts_to_array( parts, nof_parts );
+	if( array == NULL ) {
+		return -ENOMEM;
+	}
+	
+	values[0] = array;
+	values[1] = (const char *)&param2;
+	values[2] = (const char *)&param3;
+	lengths[0] = strlen( array );
+	lengths[1] = sizeof( param2 );
+	lengths[2] = sizeof( param3 );
+	
+	res = exec_read( conn, "walk_path", 3, values, lengths, binary );
+	
+	free( array );
+	
+	if( PQresultStatus( res ) != PGRES_TUPLES_OK ) {
+		syslog( LOG_ERR, "Error in psql_walk_path for path '%s': %s", path, PQerrorMessage( conn ) );
+		PQclear( res );
+		return -EIO;
+	}
+	
+	/* the starting directory vanished */
+	if( PQntuples( res ) == 0 ) {
+		PQclear( res );
+		return -ENOENT;
+	}
+	
+	for( i = 0; i < PQntuples( res ); i++ ) {
+		idx = PQfnumber( res, "id" );
+		data = PQgetvalue( res, i, idx );
+		id = be64toh( *( (int64_t *)data ) );
+		
+		get_meta_from_result( res, i, meta );
+		apply_dirty_meta( id, meta );
+		
+		remember_meta( id, meta, generation );
+		
+		if( i > 0 ) {
+			remember_dentry( meta->parent_id, parts[i-1], id, meta->mode, generation );
+		}
+	}
+	
+	idx = PQfnumber( res, "depth" );
+	data = PQgetvalue( res, PQntuples( res ) - 1, idx );
+	*depth = ntohl( *( (uint32_t *)data ) );
+	
+	PQclear( res );
+	
+	return id;
+}
+
+/* resolve a path to an id and its metadata, the dentry cache is
+ * consulted first, the remaining components not found in the cache
+ * are resolved in the database. Names known not to exist are answered
+ * from the negative cache and the first missing component found in
+ * the database is remembered there.
+ */
+static int64_t psql_resolve_path( PGconn *conn, const char *path, PgMeta *meta )
+{
 	char *copy_path;
-	char *ptr = NULL;
-	int mode = S_IFDIR;
+	char **parts;
+	int nof_parts;
+	int i;
+	int depth;
+	int64_t id;
+	int64_t parent_id;
+	int64_t next_id;
+	mode_t mode;
+	uint64_t generation;
 	
-	copy_path = strdup( path );
+	generation = fill_begin( );
+	
+	copy_path = split_path( path, &parts, &nof_parts );
 	if( copy_path == NULL ) {
 		return -ENOMEM;
 	}
 	
-	name = strtok_r( copy_path, "/", &ptr );
-	while( S_ISDIR( mode ) && name != NULL ) {
+	/* descend as far as possible with cached entries */
+	id = 0;
+	parent_id = 0;
+	mode = S_IFDIR;
+	for( i = 0; i < nof_parts && S_ISDIR( mode ) && dentry_cache != NULL; i++ ) {
+		if( touched_dentry( id, parts[i] ) ||
+			!psql_dentry_cache_lookup( dentry_cache, id, parts[i], &next_id, &mode ) ) {
+			break;
+		}
+		parent_id = id;
+		id = next_id;
+	}
+	
+	if( i < nof_parts && !S_ISDIR( mode ) ) {
+		next_id = -ENOTDIR;
+	} else if( i < nof_parts && negative_cache != NULL && !touched_dentry( id, parts[i] ) &&
+		psql_dentry_cache_lookup( negative_cache, id, parts[i], &next_id, &mode ) ) {
+		next_id = -ENOENT;
+		i = 0;
+	} else if( i == nof_parts ) {
+		/* everything cached, only the metadata is missing */
+		next_id = psql_read_meta( conn, id, path, meta );
+	} else {
+		next_id = psql_walk_path( conn, path, id, parts + i, nof_parts - i, &depth, meta, generation );
+		
+		/* we got stuck somewhere on the way down */
+		if( next_id >= 0 && i + depth < nof_parts ) {
+			if( S_ISDIR( meta->mode ) ) {
+				remember_missing( next_id, parts[i+depth], generation );
+				next_id = -ENOENT;
+			} else {
+				next_id = -ENOTDIR;
+			}
+			i = 0;
+		}
+	}
 	
-		values[0] = name;
-		lengths[0] = strlen( name );
+	/* the last cached entry is stale (removed by somebody else),
+	 * forget about it and start over from the root
+	 */
+	if( next_id == -ENOENT && i > 0 ) {
+		psql_dentry_cache_remove( dentry_cache, parent_id, parts[i-1] );
 		
-		res = PQexecParams( conn, "SELECT id, mode FROM dir WHERE name = $1::varchar and parent_id = $2::bigint",
-			2, NULL, values, lengths, binary, 1 );
-
-		if( PQresultStatus( res ) != PGRES_TUPLES_OK ) {
-			syslog( LOG_ERR, "Error in path_to_id for path '%s' in part '%s'", path, name );
-			PQclear( res );
-			free( copy_path );
-			return -EIO;
+		next_id = psql_walk_path( conn, path, 0, parts, nof_parts, &depth, meta, generation );
+		
+		if( next_id >= 0 && depth < nof_parts ) {
+			if( S_ISDIR( meta->mode ) ) {
+				remember_missing( next_id, parts[depth], generation );
+				next_id = -ENOENT;
+			} else {
+				next_id = -ENOTDIR;
+			}
 		}
+	}
+	
+	free( parts );
+	free( copy_path );
+	
+	return next_id;
+}
 
-		if( PQntuples( res ) == 0 ) {
-			PQclear( res );
-			free( copy_path );
-			return -ENOENT;
-		}
+int64_t psql_path_to_id( PGconn *conn, const char *path )
+{
+	PgMeta meta;
+	
+	return psql_resolve_path( conn, path, &meta );
+}
+
+/* --- prepared statements --- */
+
+typedef struct PgStatement {
+	const char *name;	/* name of the prepared statement */
+	const char *sql;	/* the SQL, parameter types are given by casts */
+	int nof_params;		/* number of parameters */
+} PgStatement;
+
+static const PgStatement statements[] = {
+	{ "walk_path", WALK_PATH_SQL, 3 },
+	{ "read_meta", READ_META_SQL, 1 },
+	{ "write_meta", "UPDATE dir SET size=$2::bigint, mode=$3::integer, uid=$4::integer, gid=$5::integer, ctime=$6::timestamp, mtime=$7::timestamp, atime=$8::timestamp WHERE id=$1::bigint RETURNING parent_id", 8 },
+	/* the first and last block are cut down to the requested bytes on the server */
+	{ "read_blocks", "SELECT block_no, CASE WHEN block_no=$2::bigint THEN substring( data from $4::integer + 1 for $5::integer ) "
+		"WHEN block_no=$3::bigint THEN substring( data from 1 for $6::integer ) ELSE data END AS data "
+		"FROM data WHERE dir_id=$1::bigint AND block_no>=$2::bigint AND block_no<=$3::bigint ORDER BY block_no ASC", 6 },
+	/* upsert of one block: a new block is zero-filled, then the data is placed at the offset */
+	{ "write_block", "INSERT INTO data( dir_id, block_no, data ) VALUES ( $1::bigint, $2::bigint, overlay( repeat(E'\\\\000', $5::integer)::bytea placing $3::bytea from $4::integer + 1 ) ) "
+		"ON CONFLICT( dir_id, block_no ) DO UPDATE SET data = overlay( data.data placing $3::bytea from $4::integer + 1 )", 5 },
+	/* upsert of $5 consecutive full blocks, one row per block sliced out of $3 */
+	{ "write_full_blocks", "INSERT INTO data( dir_id, block_no, data ) "
+		"SELECT $1::bigint, $2::bigint + n, substring( $3::bytea from n * $4::integer + 1 for $4::integer ) FROM generate_series( 0, $5::integer - 1 ) AS n "
+		"ON CONFLICT( dir_id, block_no ) DO UPDATE SET data = EXCLUDED.data", 5 },
+	{ "readdir", "SELECT id, name, size, mode, uid, gid, ctime, mtime, atime, parent_id FROM dir WHERE parent_id = $1::bigint", 1 },
+	{ "count_children", "SELECT COUNT(*) FROM dir where parent_id=$1::bigint", 1 },
+	{ "delete_entry", "DELETE FROM dir where id=$1::bigint RETURNING parent_id, name", 1 },
+	{ NULL, NULL, 0 }
+};
+
+int psql_prepare_statements( PGconn *conn )
+{
+	const PgStatement *s;
+	PGresult *res;
+	
+	for( s = statements; s->name != NULL; s++ ) {
+		res = PQprepare( conn, s->name, s->sql, s->nof_params, NULL );
 		
-		if( PQntuples( res ) > 1 ) {
-			syslog( LOG_ERR, "Expecting exactly one inode for path '%s' in psql_get_meta, data inconsistent!", path );
+		if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
+			syslog( LOG_ERR, "Error preparing statement '%s': %s", s->name, PQerrorMessage( conn ) );
 			PQclear( res );
-			free( copy_path );
 			return -EIO;
 		}
 		
-		idx = PQfnumber( res, "id" );
-		data = PQgetvalue( res, 0, idx );
-		id = *( (int64_t *)data );
-
-		idx = PQfnumber( res, "mode" );
-		data = PQgetvalue( res, 0, idx );
-		mode = ntohl( *( (uint32_t *)data ) );
-
 		PQclear( res );
-		
-		name = strtok_r( NULL, "/", &ptr );
 	}
 	
-	free( copy_path );
-	
-	return be64toh( id );
+	return psql_set_client( conn );
 }
 
 /* --- postgresql implementation --- */
@@ -163,16 +1207,26 @@ int64_t psql_path_to_id( PGconn *conn, const char *path )
 int64_t psql_read_meta( PGconn *conn, const int64_t id, const char *path, PgMeta *meta )
 {
 	PGresult *res;
-	int idx;
-	char *data;
-	int param1 = htonl( id );
+	int64_t param1 = htobe64( id );
 	const char *values[1] = { (const char *)&param1 };
 	int lengths[1] = { sizeof( param1 ) };
 	int binary[1] = { 1 };
 	
-	param1 = htonl( id );
-	res = PQexecParams( conn, "SELECT size, mode, uid, gid, ctime, mtime, atime, parent_id FROM dir WHERE id = $1::integer",
-		1, NULL, values, lengths, binary, 1 );
+	uint64_t generation;
+	int touched;
+	
+	touched = touched_meta( id, meta );
+	if( touched > 0 ) {
+		return id;
+	}
+	
+	generation = fill_begin( );
+	
+	if( touched == 0 && meta_cache != NULL && psql_meta_cache_lookup( meta_cache, id, meta ) ) {
+		return id;
+	}
+	
+	res = exec_read( conn, "read_meta", 1, values, lengths, binary );
 	
 	if( PQresultStatus( res ) != PGRES_TUPLES_OK ) {
 		syslog( LOG_ERR, "Error in psql_get_meta for path '%s'", path );
@@ -191,52 +1245,55 @@ int64_t psql_read_meta( PGconn *conn, const int64_t id, const char *path, PgMeta
 		return -EIO;
 	}
 	
-	idx = PQfnumber( res, "size" );
-	data = PQgetvalue( res, 0, idx );
-	meta->size = be64toh( *( (int64_t *)data ) );
-	
-	idx = PQfnumber( res, "mode" );
-	data = PQgetvalue( res, 0, idx );
-	meta->mode = ntohl( *( (uint32_t *)data ) );
-
-	idx = PQfnumber( res, "uid" );
-	data = PQgetvalue( res, 0, idx );
-	meta->uid = ntohl( *( (uint32_t *)data ) );
-
-	idx = PQfnumber( res, "gid" );
-	data = PQgetvalue( res, 0, idx );
-	meta->gid = ntohl( *( (uint32_t *)data ) );
-	
-	idx = PQfnumber( res, "ctime" );
-	data = PQgetvalue( res, 0, idx );
-	meta->ctime = convert_from_timestamp( *( (uint64_t *)data ) );
-
-	idx = PQfnumber( res, "mtime" );
-	data = PQgetvalue( res, 0, idx );
-	meta->mtime = convert_from_timestamp( *( (uint64_t *)data ) );
-
-	idx = PQfnumber( res, "atime" );
-	data = PQgetvalue( res, 0, idx );
-	meta->atime = convert_from_timestamp( *( (uint64_t *)data ) );
-
-	idx = PQfnumber( res, "parent_id" );
-	data = PQgetvalue( res, 0, idx );
-	meta->parent_id = ntohl( *( (int64_t *)data ) );
+	get_meta_from_result( res, 0, meta );
+	apply_dirty_meta( id, meta );
 	
 	PQclear( res );
 	
+	remember_meta( id, meta, generation );
+	
 	return id;
 }
 
 int64_t psql_read_meta_from_path( PGconn *conn, const char *path, PgMeta *meta )
 {
-	int id = psql_path_to_id( conn, path );
+	return psql_resolve_path( conn, path, meta );
+}
+
+int64_t psql_lookup( PGconn *conn, const int64_t parent_id, const char *name, PgMeta *meta )
+{
+	char *parts[1] = { (char *)name };
+	int depth;
+	int64_t id;
+	mode_t mode;
+	uint64_t generation;
 	
-	if( id < 0 ) {
-		return id;
+	generation = fill_begin( );
+	
+	if( touched_dentry( parent_id, name ) ) {
+		/* changed by the current transaction, ask the database */
+	} else if( dentry_cache != NULL && psql_dentry_cache_lookup( dentry_cache, parent_id, name, &id, &mode ) ) {
+		id = psql_read_meta( conn, id, name, meta );
+		if( id != -ENOENT ) {
+			return id;
+		}
+		
+		/* stale, removed by somebody else */
+		psql_dentry_cache_remove( dentry_cache, parent_id, name );
+	} else if( negative_cache != NULL && psql_dentry_cache_lookup( negative_cache, parent_id, name, &id, &mode ) ) {
+		return -ENOENT;
+	}
+	
+	id = psql_walk_path( conn, name, parent_id, parts, 1, &depth, meta, generation );
+	if( id >= 0 && depth < 1 ) {
+		if( S_ISDIR( meta->mode ) ) {
+			remember_missing( parent_id, name, generation );
+			return -ENOENT;
+		}
+		return -ENOTDIR;
 	}
 	
-	return psql_read_meta( conn, id, path, meta );
+	return id;
 }
 
 int psql_write_meta( PGconn *conn, const int64_t id, const char *path, PgMeta meta )
@@ -253,21 +1310,202 @@ int psql_write_meta( PGconn *conn, const int64_t id, const char *path, PgMeta me
 	int lengths[8] = { sizeof( param1 ), sizeof( param2 ), sizeof( param3 ), sizeof( param4 ), sizeof( param5 ), sizeof( param6 ), sizeof( param7 ), sizeof( param8 ) };
 	int binary[8] = { 1, 1, 1, 1, 1, 1, 1, 1 };
 	PGresult *res;
+	char *data;
+	uint64_t flushes = 0;
 	
-	res = PQexecParams( conn, "UPDATE dir SET size=$2::bigint, mode=$3::integer, uid=$4::integer, gid=$5::integer, ctime=$6::timestamp, mtime=$7::timestamp, atime=$8::timestamp WHERE id=$1::bigint",
-		8, NULL, values, lengths, binary, 1 );
+	BEGIN_WRITE( conn );
+	
+	forget_meta( id );
+	
+	/* a flush started before this write may still overwrite it */
+	if( lazy_meta ) {
+		(void)pthread_mutex_lock( &dirty_meta_lock );
+		flushes = flushes_started;
+		(void)pthread_mutex_unlock( &dirty_meta_lock );
+	}
+	
+	res = PQexecPrepared( conn, "write_meta", 8, values, lengths, binary, 1 );
 
-	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
+	if( PQresultStatus( res ) != PGRES_TUPLES_OK ) {
 		syslog( LOG_ERR, "Error in psql_write_meta for file '%s': %s", path, PQerrorMessage( conn ) );
 		PQclear( res );
 		return -EIO;
 	}
+	
+	/* write-through, with the precision the database stores */
+	if( PQntuples( res ) == 1 ) {
+		data = PQgetvalue( res, 0, 0 );
+		meta.parent_id = be64toh( *( (int64_t *)data ) );
+		meta.ctime.tv_nsec -= meta.ctime.tv_nsec % 1000;
+		meta.mtime.tv_nsec -= meta.mtime.tv_nsec % 1000;
+		meta.atime.tv_nsec -= meta.atime.tv_nsec % 1000;
+		touch_meta( id, &meta );
+	}
+	
+	PQclear( res );
+	
+	/* supersedes a dirty entry when the transaction commits */
+	if( lazy_meta && add_pending_meta( id, &meta, 1, flushes ) < 0 ) {
+		syslog( LOG_ERR, "Out of memory in psql_write_meta for file '%s'", path );
+		return -ENOMEM;
+	}
+	
+	return 0;
+}
+
+int psql_write_meta_lazy( PGconn *conn, const int64_t id, const char *path, PgMeta meta )
+{
+	if( !lazy_meta ) {
+		return psql_write_meta( conn, id, path, meta );
+	}
+	
+	meta.mtime.tv_nsec -= meta.mtime.tv_nsec % 1000;
+	meta.atime.tv_nsec -= meta.atime.tv_nsec % 1000;
+	
+	if( add_pending_meta( id, &meta, 0, 0 ) < 0 ) {
+		return psql_write_meta( conn, id, path, meta );
+	}
+	
+	touch_meta( id, &meta );
+	
+	return 0;
+}
+
+int psql_has_dirty_meta( const int64_t id )
+{
+	PgDirtyMeta *e;
+	int res = 0;
+	
+	if( !lazy_meta ) return 0;
+	
+	(void)pthread_mutex_lock( &dirty_meta_lock );
+	for( e = *dirty_meta_bucket( id ); e != NULL; e = e->next ) {
+		if( e->id == id ) {
+			res = 1;
+			break;
+		}
+	}
+	(void)pthread_mutex_unlock( &dirty_meta_lock );
+	
+	return res;
+}
 
+/* one UPDATE .. FROM ( VALUES .. ) for a list of dirty entries */
+static int write_dirty_meta( PGconn *conn, PgDirtyMeta *list, int nof_rows )
+{
+	int64_t ids[DIRTY_META_BATCH];
+	int64_t sizes[DIRTY_META_BATCH];
+	uint64_t mtimes[DIRTY_META_BATCH];
+	uint64_t atimes[DIRTY_META_BATCH];
+	const char *values[4 * DIRTY_META_BATCH];
+	int lengths[4 * DIRTY_META_BATCH];
+	int binary[4 * DIRTY_META_BATCH];
+	char *sql;
+	char *p;
+	PgDirtyMeta *d;
+	PGresult *res;
+	int i;
+	
+	sql = (char *)malloc( 256 + nof_rows * 96 );
+	if( sql == NULL ) {
+		return -ENOMEM;
+	}
+	
+	p = sql + sprintf( sql, "UPDATE dir SET size = v.size, mtime = v.mtime, atime = v.atime FROM ( VALUES " );
+	for( i = 0, d = list; i < nof_rows; i++, d = d->next ) {
+		ids[i] = htobe64( d->id );
+		sizes[i] = htobe64( d->size );
+		mtimes[i] = convert_to_timestamp( d->mtime );
+		atimes[i] = convert_to_timestamp( d->atime );
+		values[4*i] = (const char *)&ids[i];
+		values[4*i+1] = (const char *)&sizes[i];
+		values[4*i+2] = (const char *)&mtimes[i];
+		values[4*i+3] = (const char *)&atimes[i];
+		lengths[4*i] = sizeof( ids[i] );
+		lengths[4*i+1] = sizeof( sizes[i] );
+		lengths[4*i+2] = sizeof( mtimes[i] );
+		lengths[4*i+3] = sizeof( atimes[i] );
+		binary[4*i] = binary[4*i+1] = binary[4*i+2] = binary[4*i+3] = 1;
+		p += sprintf( p, "%s( $%d::bigint, $%d::bigint, $%d::timestamp, $%d::timestamp )",
+			( i > 0 ) ? ", " : "", 4*i+1, 4*i+2, 4*i+3, 4*i+4 );
+	}
+	sprintf( p, " ) AS v( id, size, mtime, atime ) WHERE dir.id = v.id" );
+	
+	res = PQexecParams( conn, sql, 4 * nof_rows, NULL, values, lengths, binary, 1 );
+	
+	free( sql );
+	
+	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
+		syslog( LOG_ERR, "Error writing the metadata of %d files: %s",
+			nof_rows, PQerrorMessage( conn ) );
+		PQclear( res );
+		return -EIO;
+	}
+	
 	PQclear( res );
 	
 	return 0;
 }
 
+int psql_flush_dirty_meta( PGconn *conn, const int64_t id )
+{
+	PgDirtyMeta *list = NULL;
+	PgDirtyMeta *e;
+	PgDirtyMeta *d;
+	PgDirtyMeta *batch;
+	size_t i;
+	int n;
+	int res = 0;
+	
+	if( !lazy_meta ) return 0;
+	
+	/* take copies of the entries, they stay visible in the table */
+	(void)pthread_mutex_lock( &dirty_meta_lock );
+	for( i = 0; i < DIRTY_META_BUCKETS; i++ ) {
+		if( id >= 0 && i != (uint64_t)id % DIRTY_META_BUCKETS ) continue;
+		for( e = dirty_meta[i]; e != NULL; e = e->next ) {
+			if( id >= 0 && e->id != id ) continue;
+			d = (PgDirtyMeta *)malloc( sizeof( PgDirtyMeta ) );
+			if( d == NULL ) break;
+			*d = *e;
+			d->next = list;
+			list = d;
+		}
+	}
+	flushes_started++;
+	(void)pthread_mutex_unlock( &dirty_meta_lock );
+	
+	while( list != NULL ) {
+		batch = list;
+		for( n = 1, d = list; n < DIRTY_META_BATCH && d->next != NULL; n++ ) {
+			d = d->next;
+		}
+		list = d->next;
+		
+		if( res == 0 ) {
+			res = write_dirty_meta( conn, batch, n );
+			if( res == 0 ) (void)__sync_add_and_fetch( &write_seq, 1 );
+		}
+		
+		/* written, drop the entries unless they changed in the
+		 * meantime, failed ones are kept for the next try */
+		(void)pthread_mutex_lock( &dirty_meta_lock );
+		for( i = 0; i < (size_t)n; i++ ) {
+			d = batch;
+			batch = batch->next;
+			if( res == 0 ) dirty_meta_remove( d->id, d->version );
+			free( d );
+		}
+		(void)pthread_mutex_unlock( &dirty_meta_lock );
+	}
+	
+	(void)pthread_mutex_lock( &dirty_meta_lock );
+	flushes_finished++;
+	(void)pthread_mutex_unlock( &dirty_meta_lock );
+	
+	return res;
+}
+
 int psql_create_file( PGconn *conn, const int64_t parent_id, const char *path, const char *new_file, PgMeta meta )
 {
 	int64_t param1 = htobe64( parent_id );
@@ -283,139 +1521,247 @@ int psql_create_file( PGconn *conn, const int64_t parent_id, const char *path, c
 	int binary[9] = { 1, 0, 1, 1, 1, 1, 1, 1, 1 };
 	PGresult *res;
 	
-	res = PQexecParams( conn, "INSERT INTO dir( parent_id, name, size, mode, uid, gid, ctime, mtime, atime ) VALUES ($1::bigint, $2::varchar, $3::bigint, $4::integer, $5::integer, $6::integer, $7::timestamp, $8::timestamp, $9::timestamp )",
-		9, NULL, values, lengths, binary, 1 );
-
-	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
-		syslog( LOG_ERR, "Error in psql_create_file for path '%s': %s",
-			path, PQerrorMessage( conn ) );
+	BEGIN_WRITE( conn );
+	
+	forget_dentry( parent_id, new_file );
+	
+	res = PQexecParams( conn, "INSERT INTO dir( parent_id, name, size, mode, uid, gid, ctime, mtime, atime ) VALUES ($1::bigint, $2::varchar, $3::bigint, $4::integer, $5::integer, $6::integer, $7::timestamp, $8::timestamp, $9::timestamp )",
+		9, NULL, values, lengths, binary, 1 );
+
+	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
+		syslog( LOG_ERR, "Error in psql_create_file for path '%s': %s",
+			path, PQerrorMessage( conn ) );
+		PQclear( res );
+		return -EIO;
+	}
+	
+	if( atoi( PQcmdTuples( res ) ) != 1 ) {
+		syslog( LOG_ERR, "Expecting one new row in psql_create_file, not %d!",
+			atoi( PQcmdTuples( res ) ) );
+		PQclear( res );
+		return -EIO;
+	}
+	
+	PQclear( res );
+	
+	return 0;
+}
+
+/* copy the part of a block which belongs to the range described by 'info' */
+static size_t copy_block( PgDataInfo info, const size_t block_size, const int64_t block_no, const char *data, char *dst )
+{
+	/* first block */
+	if( block_no == info.from_block ) {
+		memcpy( dst, data + info.from_offset, info.from_len );
+		return info.from_len;
+	}
+	
+	/* last block */
+	if( block_no == info.to_block ) {
+		memcpy( dst, data, info.to_len );
+		return info.to_len;
+	}
+	
+	/* intermediary blocks, are copied completly */
+	memcpy( dst, data, block_size );
+	return block_size;
+}
+
+/* copy a block sliced by the server to 'len' bytes, a short one is
+ * padded with zeroes */
+static size_t copy_slice( const char *data, const size_t data_len, const size_t len, char *dst )
+{
+	size_t n = ( data_len < len ) ? data_len : len;
+	
+	memcpy( dst, data, n );
+	memset( dst + n, 0, len - n );
+	
+	return len;
+}
+
+int psql_read_buf( PGconn *conn, const size_t block_size, const int64_t id, const char *path, char *buf, const off_t offset, const size_t len, int verbose )
+{
+	PgMeta meta;
+	int64_t tmp;
+		
+	tmp = psql_read_meta( conn, id, path, &meta );
+	if( tmp < 0 ) {
+		return tmp;
+	}
+	
+	return psql_read_data( conn, block_size, id, path, buf, offset, len, meta.size, verbose );
+}
+
+/* the bytes of a block belonging to the range described by 'info' */
+static size_t block_part_len( PgDataInfo info, const size_t block_size, const int64_t block_no )
+{
+	if( block_no == info.from_block ) return info.from_len;
+	if( block_no == info.to_block ) return info.to_len;
+	return block_size;
+}
+
+/* a hole in a sparse file, zeroed in place */
+static size_t fill_hole( PgDataInfo info, const size_t block_size, const int64_t id, const int64_t block_no, char *dst, const uint64_t generation )
+{
+	size_t len = block_part_len( info, block_size, block_no );
+	
+	memset( dst, 0, len );
+	remember_block( id, block_no, dst, 0, generation );
+	
+	return len;
+}
+
+/* receive the rows of 'read_blocks' one by one and decode each block
+ * straight into 'buf', holes are zeroed in place */
+static int64_t receive_blocks( PGconn *conn, const size_t block_size, const int64_t id, const char *path, char *buf, PgDataInfo info, const uint64_t generation, int verbose )
+{
+	PgBlockSpan span = compute_block_span( block_size, info );
+	PGresult *res;
+	ExecStatusType status;
+	int64_t block_no = info.from_block;
+	int64_t db_block_no;
+	char *data;
+	size_t data_len;
+	size_t copied = 0;
+	int err = 0;
+	
+	/* all results have to be fetched, also after an error */
+	while( ( res = PQgetResult( conn ) ) != NULL ) {
+		status = PQresultStatus( res );
+		
+		if( status == PGRES_SINGLE_TUPLE && err == 0 ) {
+			db_block_no = be64toh( *( (int64_t *)PQgetvalue( res, 0, 0 ) ) );
+			if( db_block_no < block_no || db_block_no > info.to_block ) {
+				syslog( LOG_ERR, "File '%s', unexpected block '%"PRIi64"' while reading block '%"PRIi64"'!",
+					path, db_block_no, block_no );
+				err = -EIO;
+				PQclear( res );
+				continue;
+			}
+			
+			for( ; block_no < db_block_no; block_no++ ) {
+				copied += fill_hole( info, block_size, id, block_no, buf + copied, generation );
+			}
+			
+			data = PQgetvalue( res, 0, 1 );
+			data_len = PQgetlength( res, 0, 1 );
+			
+			/* only the requested bytes of partially read blocks were sent,
+			 * they don't go to the block cache */
+			if( ( block_no == info.from_block && span.head ) ||
+				( block_no == info.to_block && span.tail ) ) {
+				copied += copy_slice( data, data_len, block_part_len( info, block_size, block_no ), buf + copied );
+			} else {
+				remember_block( id, block_no, data, data_len, generation );
+				copied += copy_block( info, block_size, block_no, data, buf + copied );
+			}
+			
+			if( verbose ) {
+				syslog( LOG_DEBUG, "File '%s', reading block '%"PRIi64"', copied: '%zu'",
+					path, block_no, copied );
+			}
+			
+			block_no++;
+		} else if( status != PGRES_SINGLE_TUPLE && status != PGRES_TUPLES_OK ) {
+			syslog( LOG_ERR, "Error in psql_read_buf for path '%s': %s",
+				path, PQerrorMessage( conn ) );
+			err = -EIO;
+		}
+		
 		PQclear( res );
-		return -EIO;
 	}
 	
-	if( atoi( PQcmdTuples( res ) ) != 1 ) {
-		syslog( LOG_ERR, "Expecting one new row in psql_create_file, not %d!",
-			atoi( PQcmdTuples( res ) ) );
-		PQclear( res );
-		return -EIO;
+	if( err < 0 ) {
+		return err;
 	}
 	
-	PQclear( res );
+	for( ; block_no <= info.to_block; block_no++ ) {
+		copied += fill_hole( info, block_size, id, block_no, buf + copied, generation );
+	}
 	
-	return 0;
+	return copied;
 }
 
-int psql_read_buf( PGconn *conn, const size_t block_size, const int64_t id, const char *path, char *buf, const off_t offset, const size_t len, int verbose )
+int psql_read_data( PGconn *conn, const size_t block_size, const int64_t id, const char *path, char *buf, const off_t offset, const size_t len, const off_t file_size, int verbose )
 {
 	PgDataInfo info;
 	int64_t param1;
 	int64_t param2;
 	int64_t param3; 
-	const char *values[3] = { (const char *)&param1, (const char *)&param2, (const char *)&param3 };
-	int lengths[3] = { sizeof( param1 ), sizeof( param2 ), sizeof( param3 ) };
-	int binary[3] = { 1, 1, 1 };
-	PGresult *res;
-	char *zero_block;
+	int param4;
+	int param5;
+	int param6;
+	const char *values[6] = { (const char *)&param1, (const char *)&param2, (const char *)&param3, (const char *)&param4, (const char *)&param5, (const char *)&param6 };
+	int lengths[6] = { sizeof( param1 ), sizeof( param2 ), sizeof( param3 ), sizeof( param4 ), sizeof( param5 ), sizeof( param6 ) };
+	int binary[6] = { 1, 1, 1, 1, 1, 1 };
 	int64_t block_no;
-	char *iptr;
-	char *data;
-	size_t copied;
-	int64_t db_block_no = 0;
-	int idx;
-	char *dst;
-	PgMeta meta;
+	int64_t copied;
+	size_t part_len;
 	size_t size;	
-	int64_t tmp;
-		
-	tmp = psql_read_meta( conn, id, path, &meta );
-	if( tmp < 0 ) {
-		return tmp;
-	}
+	uint64_t generation = 0;
+	int idle;
 		
-	if( meta.size == 0 ) {
+	if( offset >= file_size ) {
 		return 0;
 	}
 	
 	size = len;
-	if( offset + size > meta.size ) {
-		size = meta.size - offset;
+	if( offset + size > file_size ) {
+		size = file_size - offset;
 	}
 	
 	info = compute_block_info( block_size, offset, size );
 	
-	param1 = htobe64( id );
-	param2 = htobe64( info.from_block );
-	param3 = htobe64( info.to_block );
-
-	res = PQexecParams( conn, "SELECT block_no, data FROM data WHERE dir_id=$1::bigint AND block_no>=$2::bigint AND block_no<=$3::bigint ORDER BY block_no ASC",
-		3, NULL, values, lengths, binary, 1 );
-	
-	if( PQresultStatus( res ) != PGRES_TUPLES_OK ) {
-		syslog( LOG_ERR, "Error in psql_read_buf for path '%s'", path );
-		PQclear( res );
-		return -EIO;
+	/* no query needed if all blocks are cached */
+	if( block_cache != NULL ) {
+		copied = 0;
+		for( block_no = info.from_block; block_no <= info.to_block; block_no++ ) {
+			part_len = block_part_len( info, block_size, block_no );
+			if( !psql_block_cache_lookup( block_cache, id, block_no,
+				( block_no == info.from_block ) ? info.from_offset : 0, part_len, buf + copied ) ) {
+				break;
+			}
+			copied += part_len;
+		}
+		if( block_no > info.to_block ) {
+			return copied;
+		}
 	}
 	
-	zero_block = (char *)calloc( 1, block_size );
-	if( zero_block == NULL ) {
-		PQclear( res );
-		return -ENOMEM;
+	if( block_cache != NULL ) {
+		generation = psql_block_cache_generation( block_cache, id );
 	}
 	
-	dst = buf;
-	copied = 0;
-	for( block_no = info.from_block, idx = 0; block_no <= info.to_block; block_no++ ) {
-		
-		/* handle sparse files */
-		if( idx < PQntuples( res ) ) {
-			iptr = PQgetvalue( res, idx, 0 );
-			db_block_no = ntohl( *( (int64_t *)iptr ) );
-		
-			if( block_no < db_block_no ) {
-				data = zero_block;
-			} else {
-				data = PQgetvalue( res, idx, 1 );
-				idx++;
+	param1 = htobe64( id );
+	param2 = htobe64( info.from_block );
+	param3 = htobe64( info.to_block );
+	param4 = htonl( info.from_offset );
+	param5 = htonl( info.from_len );
+	param6 = htonl( info.to_len );
+	
+	/* like exec_read: retried once if the connection got lost outside
+	 * of a transaction */
+	idle = ( PQtransactionStatus( conn ) == PQTRANS_IDLE );
+	copied = send_single_row( conn, "read_blocks", 6, values, lengths, binary );
+	if( copied == 0 ) {
+		copied = receive_blocks( conn, block_size, id, path, buf, info, generation, verbose );
+	}
+	if( copied < 0 && idle && PQstatus( conn ) == CONNECTION_BAD ) {
+		syslog( LOG_WARNING, "Lost connection to database in 'read_blocks', retrying" );
+		if( psql_reconnect( conn ) == 0 ) {
+			copied = send_single_row( conn, "read_blocks", 6, values, lengths, binary );
+			if( copied == 0 ) {
+				copied = receive_blocks( conn, block_size, id, path, buf, info, generation, verbose );
 			}
-		} else {
-			data = zero_block;
-		}
-				
-		/* first block */
-		if( block_no == info.from_block ) {
-			
-			memcpy( dst, data + info.from_offset, info.from_len - info.from_offset );
-			
-			dst += info.from_len;
-			copied += info.from_len;
-			
-		/* last block */
-		} else if( block_no == info.to_block ) {
-			
-			memcpy( dst, data, info.to_len );
-			copied += info.to_len;
-		
-		/* intermediary blocks, are copied completly */
-		} else {
-			
-			memcpy( dst, data, block_size );
-			dst += block_size;
-			copied += block_size;
-		}
-
-		if( verbose ) {
-			syslog( LOG_DEBUG, "File '%s', reading block '%"PRIi64"', copied: '%zu', DB block: '%"PRIi64"'",
-				path, block_no, copied, db_block_no );
 		}
 	}
-
-	PQclear( res );
-	
-	free( zero_block );
+	if( copied < 0 ) {
+		return copied;
+	}
 	
-	if( copied != size ) {
-		syslog( LOG_ERR, "File '%s', reading block '%"PRIi64"', copied '%zu' bytes but expecting '%zu'!",
-			path, block_no, copied, size );
+	if( (size_t)copied != size ) {
+		syslog( LOG_ERR, "File '%s', reading blocks '%"PRIi64"' to '%"PRIi64"', copied '%"PRIi64"' bytes but expecting '%zu'!",
+			path, info.from_block, info.to_block, copied, size );
 		return -EIO;
 	}
 	
@@ -429,12 +1775,19 @@ int psql_readdir( PGconn *conn, const int64_t parent_id, void *buf, fuse_fill_di
 	int lengths[1] = { sizeof( param1 ) };
 	int binary[1] = { 1 };
 	PGresult *res;
+	int i_id;
 	int i_name;
 	int i;
+	int64_t id;
 	char *name;
+	char *data;
+	struct stat st;
+	PgMeta meta;
+	uint64_t generation;
+	
+	generation = fill_begin( );
 	
-	res = PQexecParams( conn, "SELECT name FROM dir WHERE parent_id = $1::bigint",
-		1, NULL, values, lengths, binary, 1 );
+	res = exec_read( conn, "readdir", 1, values, lengths, binary );
 	
 	if( PQresultStatus( res ) != PGRES_TUPLES_OK ) {
 		syslog( LOG_ERR, "Error in psql_readdir for dir with id '%20"PRIu64"': %s",
@@ -443,11 +1796,32 @@ int psql_readdir( PGconn *conn, const int64_t parent_id, void *buf, fuse_fill_di
 		return -EIO;
 	}
 	
+	i_id = PQfnumber( res, "id" );
 	i_name = PQfnumber( res, "name" );
+	memset( &st, 0, sizeof( st ) );
 	for( i = 0; i < PQntuples( res ); i++ ) {
 		name = PQgetvalue( res, i, i_name );
 		if( strcmp( name, "/" ) == 0 ) continue;
-		filler( buf, name, NULL, 0 );
+		data = PQgetvalue( res, i, i_id );
+		id = be64toh( *( (int64_t *)data ) );
+		get_meta_from_result( res, i, &meta );
+		apply_dirty_meta( id, &meta );
+		
+		/* the getattr/lookup following for every entry (ls -l) are
+		 * served from the caches */
+		remember_meta( id, &meta, generation );
+		remember_dentry( parent_id, name, id, meta.mode, generation );
+		
+		st.st_ino = id;
+		st.st_mode = meta.mode;
+		st.st_size = meta.size;
+		st.st_nlink = 1;
+		st.st_uid = meta.uid;
+		st.st_gid = meta.gid;
+		st.st_atime = meta.atime.tv_sec;
+		st.st_mtime = meta.mtime.tv_sec;
+		st.st_ctime = meta.ctime.tv_sec;
+		filler( buf, name, &st, 0 );
         }
         
 	PQclear( res );
@@ -469,6 +1843,10 @@ int psql_create_dir( PGconn *conn, const int64_t parent_id, const char *path, co
 	int binary[8] = { 1, 0, 1, 1, 1, 1, 1, 1 };
 	PGresult *res;
 	
+	BEGIN_WRITE( conn );
+	
+	forget_dentry( parent_id, new_dir );
+	
 	res = PQexecParams( conn, "INSERT INTO dir( parent_id, name, mode, uid, gid, ctime, mtime, atime ) VALUES ($1::bigint, $2::varchar, $3::integer, $4::integer, $5::integer, $6::timestamp, $7::timestamp, $8::timestamp )",
 		8, NULL, values, lengths, binary, 1 );
 
@@ -500,8 +1878,9 @@ int psql_delete_dir( PGconn *conn, const int64_t id, const char *path )
 	char *iptr;
 	int count;
 	
-	res = PQexecParams( conn, "SELECT COUNT(*) FROM dir where parent_id=$1::bigint",
-		1, NULL, values, lengths, binary, 0 );
+	BEGIN_WRITE( conn );
+	
+	res = PQexecPrepared( conn, "count_children", 1, values, lengths, binary, 0 );
 		
 	if( PQresultStatus( res ) != PGRES_TUPLES_OK ) {
 		syslog( LOG_ERR, "Error in psql_delete_dir for path '%s': %s", path, PQerrorMessage( conn ) );
@@ -525,15 +1904,17 @@ int psql_delete_dir( PGconn *conn, const int64_t id, const char *path )
 
 	PQclear( res );
 		
-	res = PQexecParams( conn, "DELETE FROM dir where id=$1::bigint",
-		1, NULL, values, lengths, binary, 1 );
+	res = PQexecPrepared( conn, "delete_entry", 1, values, lengths, binary, 1 );
 
-	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
+	if( PQresultStatus( res ) != PGRES_TUPLES_OK ) {
 		syslog( LOG_ERR, "Error in psql_delete_dir for path '%s': %s", path, PQerrorMessage( conn ) );
 		PQclear( res );
 		return -EIO;
 	}
 	
+	forget_deleted( res );
+	forget_meta( id );
+	
 	PQclear( res );
 	
 	return 0;
@@ -546,31 +1927,72 @@ int psql_delete_file( PGconn *conn, const int64_t id, const char *path )
 	int lengths[1] = { sizeof( param1 ) };
 	int binary[1] = { 1 };
 	PGresult *res;
+	PgMeta meta;
+	int64_t tmp;
+	
+	BEGIN_WRITE( conn );
+	
+	/* the size tells which blocks the dir_remove rule deletes */
+	tmp = psql_read_meta( conn, id, path, &meta );
+	if( tmp < 0 ) {
+		return tmp;
+	}
 	
-	res = PQexecParams( conn, "DELETE FROM dir where id=$1::bigint",
-		1, NULL, values, lengths, binary, 1 );
+	res = PQexecPrepared( conn, "delete_entry", 1, values, lengths, binary, 1 );
 
-	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
+	if( PQresultStatus( res ) != PGRES_TUPLES_OK ) {
 		syslog( LOG_ERR, "Error in psql_delete_dir for path '%s': %s",
 			path, PQerrorMessage( conn ) );
 		PQclear( res );
 		return -EIO;
 	}
 	
+	forget_deleted( res );
+	forget_meta( id );
+	if( block_cache != NULL ) {
+		forget_blocks( id, 0, ( meta.size + block_cache->block_size - 1 ) / block_cache->block_size );
+	}
+	
 	PQclear( res );
 	
 	return 0;
 }
 
+/* parameters of the statement writing one block */
+typedef struct PgBlockParams {
+	int64_t id;		/* dir_id (big-endian) */
+	int64_t block_no;	/* number of the block (big-endian) */
+	int offset;		/* offset of the data in the block (network order) */
+	int block_size;		/* size of a newly allocated block (network order) */
+	const char *values[5];
+	int lengths[5];
+} PgBlockParams;
+
+static const int block_binary[5] = { 1, 1, 1, 1, 1 };
+
+static void init_block_params( PgBlockParams *p, const size_t block_size, const int64_t id, const char *buf, const int64_t block_no, const off_t offset, const size_t len )
+{
+	p->id = htobe64( id );
+	p->block_no = htobe64( block_no );
+	p->offset = htonl( offset );
+	p->block_size = htonl( block_size );
+	
+	p->values[0] = (const char *)&p->id;
+	p->values[1] = (const char *)&p->block_no;
+	p->values[2] = buf;
+	p->values[3] = (const char *)&p->offset;
+	p->values[4] = (const char *)&p->block_size;
+	p->lengths[0] = sizeof( p->id );
+	p->lengths[1] = sizeof( p->block_no );
+	p->lengths[2] = len;
+	p->lengths[3] = sizeof( p->offset );
+	p->lengths[4] = sizeof( p->block_size );
+}
+
 static int psql_write_block( PGconn *conn, const size_t block_size, const int64_t id, const char *path, const char *buf, const int64_t block_no, const off_t offset, const size_t len, int verbose )
 {
-	int64_t param1 = htobe64( id );
-	int64_t param2 = htobe64( block_no );
-	const char *values[3] = { (const char *)&param1, (const char *)&param2, buf };
-	int lengths[3] = { sizeof( param1 ), sizeof( param2 ), len };
-	int binary[3] = { 1, 1, 1 };
+	PgBlockParams p;
 	PGresult *res;
-	char sql[256];
 	
 	/* could actually be an assertion, as this can never happen */
 	if( offset + len > block_size ) {
@@ -578,146 +2000,317 @@ static int psql_write_block( PGconn *conn, const size_t block_size, const int64_
 			path, block_no, offset, len, block_size );
 		return -EIO;
 	}
+	
+	init_block_params( &p, block_size, id, buf, block_no, offset, len );
 
-update_again:
-
-	/* write a complete block, old data in the database doesn't bother us */
-	if( offset == 0 && len == block_size ) {
-		
-		strcpy( sql, "UPDATE data set data = $3::bytea WHERE dir_id=$1::bigint AND block_no=$2::bigint" );
-		
-	/* keep data on the right */
-	} else if( offset == 0 && len < block_size ) {
+	if( verbose ) {
+		syslog( LOG_DEBUG, "%s, block: %"PRIi64", offset: %jd, len: %zu\n",
+			path, block_no, offset, len );
+	}
+	
+	res = PQexecPrepared( conn, "write_block", 5, p.values, p.lengths, block_binary, 1 );
+	
+	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
+		syslog( LOG_ERR, "Error in psql_write_block(%"PRIi64",%jd,%zu) for file '%s': %s",
+			block_no, offset, len, path, PQerrorMessage( conn ) );
+		PQclear( res );
+		return -EIO;
+	}
 
-		sprintf( sql, "UPDATE data set data = $3::bytea || substring( data from %zu for %zu ) WHERE dir_id=$1::bigint AND block_no=$2::bigint",
-			len + 1, block_size - len );
+	/* funny problems */
+	if( atoi( PQcmdTuples( res ) ) != 1 ) {
+		syslog( LOG_ERR, "Unable to write block '%"PRIi64"' of file '%s'! Data consistency problems!",
+			block_no, path );
+		PQclear( res );
+		return -EIO;
+	}
+	
+	PQclear( res );
+	
+	remember_block_write( id, block_no, buf, offset, len, block_size );
+	
+	return len;
+}
 
-	/* keep data on the left */
-	} else if( offset > 0 && offset + len == block_size ) {
-		
-		sprintf( sql, "UPDATE data set data = substring( data from %d for %jd ) || $3::bytea WHERE dir_id=$1::bigint AND block_no=$2::bigint",
-			1, offset );
+/* parameters of the statement writing consecutive full blocks */
+typedef struct PgFullBlocksParams {
+	int64_t id;		/* dir_id (big-endian) */
+	int64_t block_no;	/* number of the first block (big-endian) */
+	int block_size;		/* size of a block (network order) */
+	int nof_blocks;		/* number of blocks (network order) */
+	const char *values[5];
+	int lengths[5];
+} PgFullBlocksParams;
+
+static void init_full_blocks_params( PgFullBlocksParams *p, const size_t block_size, const int64_t id, const char *buf, const int64_t block_no, const size_t nof_blocks )
+{
+	p->id = htobe64( id );
+	p->block_no = htobe64( block_no );
+	p->block_size = htonl( block_size );
+	p->nof_blocks = htonl( nof_blocks );
+	
+	p->values[0] = (const char *)&p->id;
+	p->values[1] = (const char *)&p->block_no;
+	p->values[2] = buf;
+	p->values[3] = (const char *)&p->block_size;
+	p->values[4] = (const char *)&p->nof_blocks;
+	p->lengths[0] = sizeof( p->id );
+	p->lengths[1] = sizeof( p->block_no );
+	p->lengths[2] = nof_blocks * block_size;
+	p->lengths[3] = sizeof( p->block_size );
+	p->lengths[4] = sizeof( p->nof_blocks );
+}
 
-	/* small in the middle write, keep data on both sides */
-	} else if( offset > 0 && offset + len < block_size ) {
+static void remember_full_blocks( const int64_t id, const char *buf, const int64_t block_no, const size_t nof_blocks, const size_t block_size )
+{
+	size_t i;
+	
+	for( i = 0; i < nof_blocks; i++ ) {
+		remember_block_write( id, block_no + i, buf + i * block_size, 0, block_size, block_size );
+	}
+}
 
-		sprintf( sql, "UPDATE data set data = substring( data from %d for %jd ) || $3::bytea || substring( data from %jd for %jd ) WHERE dir_id=$1::bigint AND block_no=$2::bigint",
-			1, offset,
-			offset + len + 1, block_size - ( offset + len ) );
-						
-	/* we should never get here */
-	} else {
-		syslog( LOG_ERR, "Unhandled write case for file '%s' in block '%"PRIi64"': offset: %jd, len: %zu, blocksize: %zu",
-			path, block_no, offset, len, block_size );
-		return -EIO;
-	}		
+/* write 'nof_blocks' full blocks starting at 'block_no' with one statement */
+static int psql_write_full_blocks( PGconn *conn, const size_t block_size, const int64_t id, const char *path, const char *buf, const int64_t block_no, const size_t nof_blocks, int verbose )
+{
+	PgFullBlocksParams p;
+	PGresult *res;
+	
+	init_full_blocks_params( &p, block_size, id, buf, block_no, nof_blocks );
 	
 	if( verbose ) {
-		syslog( LOG_DEBUG, "%s, block: %"PRIi64", offset: %jd, len: %zu => %s\n",
-			path, block_no, offset, len, sql );
+		syslog( LOG_DEBUG, "%s, blocks: %"PRIi64" to %"PRIi64"\n",
+			path, block_no, block_no + (int64_t)nof_blocks - 1 );
 	}
 	
-	res = PQexecParams( conn, sql, 3, NULL, values, lengths, binary, 1 );
+	res = PQexecPrepared( conn, "write_full_blocks", 5, p.values, p.lengths, block_binary, 1 );
 	
 	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
-		syslog( LOG_ERR, "Error in psql_write_block(%"PRIi64",%jd,%zu) for file '%s' (%s): %s",
-			block_no, offset, len, path,
-			sql, PQerrorMessage( conn ) );
+		syslog( LOG_ERR, "Error in psql_write_full_blocks(%"PRIi64",%zu) for file '%s': %s",
+			block_no, nof_blocks, path, PQerrorMessage( conn ) );
 		PQclear( res );
 		return -EIO;
 	}
-
-	/* ok, one block updated */
-	if( atoi( PQcmdTuples( res ) ) == 1 ) {
+	
+	if( atoi( PQcmdTuples( res ) ) != (int)nof_blocks ) {
+		syslog( LOG_ERR, "Unable to write blocks '%"PRIi64"' to '%"PRIi64"' of file '%s'! Data consistency problems!",
+			block_no, block_no + (int64_t)nof_blocks - 1, path );
 		PQclear( res );
-		return len;
+		return -EIO;
 	}
+	
+	PQclear( res );
+	
+	remember_full_blocks( id, buf, block_no, nof_blocks, block_size );
+	
+	return nof_blocks * block_size;
+}
 
-	/* funny problems */
-	if( atoi( PQcmdTuples( res ) ) != 0 ) {
-		syslog( LOG_ERR, "Unable to update block '%"PRIi64"' of file '%s'! Data consistency problems!",
-			block_no, path );
+#ifdef LIBPQ_HAS_PIPELINING
+
+/* fetch the result of the next statement in the pipeline and the
+ * number of rows it touched */
+static int pipeline_result( PGconn *conn, const char *path, const int64_t block_no, int *rows )
+{
+	PGresult *res;
+	
+	res = PQgetResult( conn );
+	if( res == NULL || PQresultStatus( res ) != PGRES_COMMAND_OK ) {
+		syslog( LOG_ERR, "Error in pipelined write of block '%"PRIi64"' of file '%s': %s",
+			block_no, path, PQerrorMessage( conn ) );
 		PQclear( res );
 		return -EIO;
 	}
 	
+	*rows = atoi( PQcmdTuples( res ) );
 	PQclear( res );
 	
-	/* the block didn't exist, so create one */
-	sprintf( sql, "INSERT INTO data( dir_id, block_no, data ) VALUES"
-		" ( $1::bigint, $2::bigint, repeat(E'\\\\000',%zu)::bytea )", block_size );
-	res = PQexecParams( conn, sql, 2, NULL, values, lengths, binary, 1 );
-
-	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
-		syslog( LOG_ERR, "Error in psql_write_block(%"PRIi64",%jd,%zu) for file '%s' allocating new block '%"PRIi64"': %s",
-			block_no, offset, len, path, block_no, PQerrorMessage( conn ) );
+	/* NULL marks the end of the results of this statement */
+	res = PQgetResult( conn );
+	if( res != NULL ) {
 		PQclear( res );
 		return -EIO;
 	}
 	
-	if( atoi( PQcmdTuples( res ) ) != 1 ) {
-		syslog( LOG_ERR, "Unable to add new block '%"PRIi64"' of file '%s'! Data consistency problems!",
-			block_no, path );
+	return 0;
+}
+
+/* skip the remaining (possibly aborted) results up to the sync point */
+static void pipeline_drain( PGconn *conn )
+{
+	PGresult *res;
+	ExecStatusType status;
+	int nulls = 0;
+	
+	/* two NULLs in a row: nothing left in the queue */
+	for( ;; ) {
+		res = PQgetResult( conn );
+		if( res == NULL ) {
+			if( PQstatus( conn ) == CONNECTION_BAD || ++nulls > 1 ) break;
+			continue;
+		}
+		nulls = 0;
+		status = PQresultStatus( res );
 		PQclear( res );
+		if( status == PGRES_PIPELINE_SYNC ) break;
+	}
+}
+
+/* send the statements for the partial and the full blocks of a write
+ * in one batch */
+static int psql_write_blocks_pipelined( PGconn *conn, const size_t block_size, const int64_t id, const char *path, const char *buf, PgDataInfo info, int verbose )
+{
+	PgBlockSpan span = compute_block_span( block_size, info );
+	const char *full_buf = buf + ( span.head ? info.from_len : 0 );
+	const char *tail_buf = full_buf + span.nof_full * block_size;
+	PgBlockParams head;
+	PgFullBlocksParams full;
+	PgBlockParams tail;
+	int rows;
+	int res = 0;
+	
+	if( !PQenterPipelineMode( conn ) ) {
+		syslog( LOG_ERR, "Entering pipeline mode failed for file '%s': %s", path, PQerrorMessage( conn ) );
 		return -EIO;
 	}
 	
-	PQclear( res );
+	/* a failing batch aborts the transaction and flushes the caches */
+	if( span.head ) {
+		init_block_params( &head, block_size, id, buf, info.from_block, info.from_offset, info.from_len );
+		remember_block_write( id, info.from_block, buf, info.from_offset, info.from_len, block_size );
+		if( !PQsendQueryPrepared( conn, "write_block", 5, head.values, head.lengths, block_binary, 1 ) ) {
+			res = -EIO;
+		}
+	}
+	if( res == 0 && span.nof_full > 0 ) {
+		init_full_blocks_params( &full, block_size, id, full_buf, span.first_full, span.nof_full );
+		remember_full_blocks( id, full_buf, span.first_full, span.nof_full, block_size );
+		if( !PQsendQueryPrepared( conn, "write_full_blocks", 5, full.values, full.lengths, block_binary, 1 ) ) {
+			res = -EIO;
+		}
+	}
+	if( res == 0 && span.tail ) {
+		init_block_params( &tail, block_size, id, tail_buf, info.to_block, 0, info.to_len );
+		remember_block_write( id, info.to_block, tail_buf, 0, info.to_len, block_size );
+		if( !PQsendQueryPrepared( conn, "write_block", 5, tail.values, tail.lengths, block_binary, 1 ) ) {
+			res = -EIO;
+		}
+	}
+	if( !PQpipelineSync( conn ) ) {
+		res = -EIO;
+	}
+	
+	if( res == 0 && span.head ) {
+		res = pipeline_result( conn, path, info.from_block, &rows );
+		if( res == 0 && rows != 1 ) {
+			syslog( LOG_ERR, "Unable to write block '%"PRIi64"' of file '%s'! Data consistency problems!",
+				info.from_block, path );
+			res = -EIO;
+		}
+	}
+	if( res == 0 && span.nof_full > 0 ) {
+		res = pipeline_result( conn, path, span.first_full, &rows );
+		if( res == 0 && rows != (int)span.nof_full ) {
+			syslog( LOG_ERR, "Unable to write blocks '%"PRIi64"' to '%"PRIi64"' of file '%s'! Data consistency problems!",
+				span.first_full, span.first_full + (int64_t)span.nof_full - 1, path );
+			res = -EIO;
+		}
+	}
+	if( res == 0 && span.tail ) {
+		res = pipeline_result( conn, path, info.to_block, &rows );
+		if( res == 0 && rows != 1 ) {
+			syslog( LOG_ERR, "Unable to write block '%"PRIi64"' of file '%s'! Data consistency problems!",
+				info.to_block, path );
+			res = -EIO;
+		}
+	}
+	pipeline_drain( conn );
+	
+	if( verbose ) {
+		syslog( LOG_DEBUG, "%s, blocks %"PRIi64" to %"PRIi64" written in one batch",
+			path, info.from_block, info.to_block );
+	}
 	
-	goto update_again;
+	(void)PQexitPipelineMode( conn );
+	
+	return res;
 }
 
+#endif
+
 int psql_write_buf( PGconn *conn, const size_t block_size, const int64_t id, const char *path, const char *buf, const off_t offset, const size_t len, int verbose )
 {
 	PgDataInfo info;
+	PgBlockSpan span;
 	int res;
-	int64_t block_no;
 	
 	if( len == 0 ) return 0;
 	
+	BEGIN_WRITE( conn );
+	
 	info = compute_block_info( block_size, offset, len );
 	
-	/* first (partial) block */
-	res = psql_write_block( conn, block_size, id, path, buf, info.from_block, info.from_offset, info.from_len, verbose );
-	if( res < 0 ) {
-		return res;
-	}
-	if( res != info.from_len ) {
-		syslog( LOG_ERR, "Partial write in file '%s' in first block '%"PRIi64"' (%u instead of %zu octets)",
-			path, info.from_block, res, info.from_len );
-		return -EIO;
+#ifdef LIBPQ_HAS_PIPELINING
+	/* more than one block, send all statements in one batch */
+	if( info.from_block != info.to_block ) {
+		res = psql_write_blocks_pipelined( conn, block_size, id, path, buf, info, verbose );
+		if( res < 0 ) {
+			return res;
+		}
+		return len;
 	}
+#endif
 	
 	/* special case of one block */
 	if( info.from_block == info.to_block ) {
+		res = psql_write_block( conn, block_size, id, path, buf, info.from_block, info.from_offset, info.from_len, verbose );
+		if( res < 0 ) {
+			return res;
+		}
+		if( res != info.from_len ) {
+			syslog( LOG_ERR, "Partial write in file '%s' in block '%"PRIi64"' (%u instead of %zu octets)",
+				path, info.from_block, res, info.from_len );
+			return -EIO;
+		}
 		return res;
 	}
 	
-	buf += info.from_len;
+	span = compute_block_span( block_size, info );
 	
-	/* all full blocks */
-	for( block_no = info.from_block + 1; block_no < info.to_block; block_no++ ) {
-		res = psql_write_block( conn, block_size, id, path, buf, block_no, 0, block_size, verbose );
+	/* first partial block */
+	if( span.head ) {
+		res = psql_write_block( conn, block_size, id, path, buf, info.from_block, info.from_offset, info.from_len, verbose );
 		if( res < 0 ) {
 			return res;
 		}
-		if( res != block_size ) {
-			syslog( LOG_ERR, "Partial write in file '%s' in block '%"PRIi64"' (%u instead of %zu octets)",
-				path, block_no, res, block_size );
+		if( res != info.from_len ) {
+			syslog( LOG_ERR, "Partial write in file '%s' in first block '%"PRIi64"' (%u instead of %zu octets)",
+				path, info.from_block, res, info.from_len );
 			return -EIO;
 		}
-		buf += block_size;
+		buf += info.from_len;
 	}
 	
-	/* last partial block */
-	res = psql_write_block( conn, block_size, id, path, buf, info.to_block, 0, info.to_len, verbose );
-	if( res < 0 ) {
-		return res;
+	/* all full blocks in one statement */
+	if( span.nof_full > 0 ) {
+		res = psql_write_full_blocks( conn, block_size, id, path, buf, span.first_full, span.nof_full, verbose );
+		if( res < 0 ) {
+			return res;
+		}
+		buf += span.nof_full * block_size;
 	}
-	if( res != info.to_len ) {
-		syslog( LOG_ERR, "Partial write in file '%s' in last block '%"PRIi64"' (%u instead of %zu octets)",
-			path, block_no, res, info.to_len );
-		return -EIO;
+	
+	/* last partial block */
+	if( span.tail ) {
+		res = psql_write_block( conn, block_size, id, path, buf, info.to_block, 0, info.to_len, verbose );
+		if( res < 0 ) {
+			return res;
+		}
+		if( res != info.to_len ) {
+			syslog( LOG_ERR, "Partial write in file '%s' in last block '%"PRIi64"' (%u instead of %zu octets)",
+				path, info.to_block, res, info.to_len );
+			return -EIO;
+		}
 	}
 	
 	return len;
@@ -736,6 +2329,8 @@ int psql_truncate( PGconn *conn, const size_t block_size, const int64_t id, cons
 	PGresult *dbres;
 	char sql[256];
 	
+	BEGIN_WRITE( conn );
+	
 	res = psql_read_meta( conn, id, path, &meta );
 	if( res < 0 ) {
 		return res;
@@ -743,6 +2338,9 @@ int psql_truncate( PGconn *conn, const size_t block_size, const int64_t id, cons
 	
 	info = compute_block_info( block_size, 0, offset );
 	
+	/* the now last block gets padded, the ones after it deleted */
+	forget_blocks( id, info.to_block, ( meta.size + block_size - 1 ) / block_size );
+	
 	param1 = htobe64( id );
 	param2 = htobe64( info.to_block );
 	
@@ -800,17 +2398,14 @@ int psql_truncate( PGconn *conn, const size_t block_size, const int64_t id, cons
 
 int psql_begin( PGconn *conn )
 {
-	PGresult *res;
-	
-	res = PQexec( conn, "BEGIN" );
-	
-	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
-		syslog( LOG_ERR, "Begin of transaction failed!!" );
-		return -EIO;
+	/* nothing to send, see begin_write, but a transaction left open
+	 * by an earlier operation must not leak into this one
+	 */
+	if( PQtransactionStatus( conn ) != PQTRANS_IDLE ) {
+		syslog( LOG_ERR, "Found a dangling transaction, rolling back" );
+		return psql_rollback( conn );
 	}
 	
-	PQclear( res );
-	
 	return 0;
 }
 
@@ -818,24 +2413,62 @@ int psql_commit( PGconn *conn )
 {
 	PGresult *res;
 	
+	/* only reads in autocommit mode, nothing to commit */
+	if( PQtransactionStatus( conn ) == PQTRANS_IDLE ) {
+		publish_pending_meta( );
+		tx_end( 1 );
+		return 0;
+	}
+	
+	/* a COMMIT of a failed transaction reports success, but rolls back */
+	if( PQtransactionStatus( conn ) == PQTRANS_INERROR ) {
+		syslog( LOG_ERR, "Commit of a failed transaction, rolling back" );
+		(void)psql_rollback( conn );
+		return -EIO;
+	}
+	
 	res = PQexec( conn, "COMMIT" );
 	
 	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
 		syslog( LOG_ERR, "Commit of transaction failed!!" );
+		PQclear( res );
+		discard_pending_meta( );
+		if( tx_is_dirty( ) ) flush_caches( );
+		tx_end( 0 );
 		return -EIO;
 	}
 	
 	PQclear( res );
 	
+	publish_pending_meta( );
+	tx_end( 1 );
+	(void)__sync_add_and_fetch( &write_seq, 1 );
+	
 	return 0;
 }
 
+uint64_t psql_write_seq( void )
+{
+	return __sync_add_and_fetch( &write_seq, 0 );
+}
+
 int psql_rollback( PGconn *conn )
 {
 	PGresult *res;
 	
+	discard_pending_meta( );
+	
+	if( PQtransactionStatus( conn ) == PQTRANS_IDLE ) {
+		if( tx_is_dirty( ) ) flush_caches( );
+		tx_end( 0 );
+		return 0;
+	}
+	
 	res = PQexec( conn, "ROLLBACK" );
 	
+	if( tx_is_dirty( ) ) flush_caches( );
+	tx_end( 0 );
+	
 	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
 		syslog( LOG_ERR, "Rollback of transaction failed!!" );
 		return -EIO;
@@ -858,6 +2491,8 @@ int psql_rename( PGconn *conn, const int64_t from_id, const int64_t from_parent_
 	int binary[3] = { 1, 0, 1 };
 	PGresult *res;
 	
+	BEGIN_WRITE( conn );
+	
 	id = psql_read_meta( conn, from_parent_id, from, &from_parent_meta );
 	if( id < 0 ) {
 		return id;
@@ -880,6 +2515,10 @@ int psql_rename( PGconn *conn, const int64_t from_id, const int64_t from_parent_
 		return -EIO;
 	}
 	
+	forget_dentry( from_parent_id, last_component( from ) );
+	forget_dentry( to_parent_id, rename_to );
+	forget_meta( from_id );
+	
 	res = PQexecParams( conn, "UPDATE dir SET parent_id=$1::bigint, name=$2::varchar WHERE id=$3::bigint",
 		3, NULL, values, lengths, binary, 1 );
 
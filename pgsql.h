@@ -68,6 +68,46 @@ int psql_commit( PGconn *conn );
 
 int psql_rollback( PGconn *conn );
 
+/* --- prepared statements of the hot paths, once per connection --- */
+
+int psql_prepare_statements( PGconn *conn );
+
+/* reestablishes a lost connection and prepares the statements again */
+int psql_reconnect( PGconn *conn );
+
+/* number of write transactions committed so far */
+uint64_t psql_write_seq( void );
+
+/* --- changes by other clients --- */
+
+/* the id of this mount in the change notifications */
+const char *psql_client_id( void );
+
+/* tags the changes done on the connection with our client id */
+int psql_set_client( PGconn *conn );
+
+/* drops cached metadata of 'id' and the name 'name' in 'parent_id' */
+void psql_invalidate_dir( const int64_t id, const int64_t parent_id, const char *name );
+
+/* drops the cached data blocks of file 'id' */
+void psql_invalidate_data( const int64_t id );
+
+void psql_invalidate_all( void );
+
+/* --- caches consulted and maintained by the filesystem functions --- */
+
+struct PgDentryCache;
+struct PgMetaCache;
+struct PgBlockCache;
+
+void psql_set_dentry_cache( struct PgDentryCache *cache );
+
+void psql_set_negative_cache( struct PgDentryCache *cache );
+
+void psql_set_meta_cache( struct PgMetaCache *cache );
+
+void psql_set_block_cache( struct PgBlockCache *cache );
+
 /* --- the filesystem functions --- */
 
 int64_t psql_path_to_id( PGconn *conn, const char *path );
@@ -76,12 +116,30 @@ int64_t psql_read_meta( PGconn *conn, const int64_t id, const char *path, PgMeta
 
 int64_t psql_read_meta_from_path( PGconn *conn, const char *path, PgMeta *meta );
 
+int64_t psql_lookup( PGconn *conn, const int64_t parent_id, const char *name, PgMeta *meta );
+
 int psql_write_meta( PGconn *conn, const int64_t id, const char *path, PgMeta meta );
 
+/* --- lazily written metadata (size, mtime, atime) --- */
+
+void psql_set_lazy_meta( int lazy );
+
+/* like psql_write_meta, but only the size and times, written later by
+ * psql_flush_dirty_meta after the transaction commits */
+int psql_write_meta_lazy( PGconn *conn, const int64_t id, const char *path, PgMeta meta );
+
+int psql_has_dirty_meta( const int64_t id );
+
+/* writes the metadata of the file 'id' or of all files if 'id' < 0 */
+int psql_flush_dirty_meta( PGconn *conn, const int64_t id );
+
 int psql_create_file( PGconn *conn, const int64_t parent_id, const char *path, const char *new_file, PgMeta meta );
 
 int psql_read_buf( PGconn *conn, const size_t block_size, const int64_t id, const char *path, char *buf, const off_t offset, const size_t len, int verbose );
 
+/* like psql_read_buf, but the caller knows the size of the file */
+int psql_read_data( PGconn *conn, const size_t block_size, const int64_t id, const char *path, char *buf, const off_t offset, const size_t len, const off_t file_size, int verbose );
+
 int psql_readdir( PGconn *conn, const int64_t parent_id, void *buf, fuse_fill_dir_t filler );
 
 int psql_create_dir( PGconn *conn, const int64_t parent_id, const char *path, const char *new_dir, PgMeta meta );
@@ -16,58 +16,275 @@
 */
 
 #include "pool.h"
+#include "pgsql.h"
+#include "config.h"
 
 #include <string.h>		/* for strlen, memcpy, strcmp */
 #include <errno.h>		/* for ENOENT and friends */
 #include <stdlib.h>		/* for malloc */
 #include <syslog.h>		/* for syslog */
+#include <time.h>		/* for clock_gettime */
 
 #define AVAILABLE -1
 #define ERROR -2
+#define UNUSED -3
+#define CONNECTING -4
 
-int psql_pool_init( PgConnPool *pool, const char *conninfo, const size_t max_connections )
+static uint64_t now_ms( void )
+{
+	struct timespec t;
+
+	if( clock_gettime( CLOCK_MONOTONIC, &t ) != 0 ) {
+		return 0;
+	}
+
+	return (uint64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+static int is_open( pthread_t state )
+{
+	return state != (pthread_t)ERROR && state != (pthread_t)UNUSED && state != (pthread_t)CONNECTING;
+}
+
+/* opens a connection, called without holding the pool lock */
+static PGconn *open_conn( const char *conninfo )
+{
+	PGconn *conn;
+	
+	conn = PQconnectdb( conninfo );
+	if( PQstatus( conn ) != CONNECTION_OK ) {
+		syslog( LOG_ERR, "Connection to database failed: %s",
+			PQerrorMessage( conn ) );
+		PQfinish( conn );
+		return NULL;
+	}
+	
+	if( psql_prepare_statements( conn ) < 0 ) {
+		PQfinish( conn );
+		return NULL;
+	}
+	
+	return conn;
+}
+
+/* the slot 'i' is marked CONNECTING, opens the connection and gives it
+ * to 'owner' or sets the slot to 'fail_state', called and returns with
+ * the pool lock held */
+static int connect_slot( PgConnPool *pool, size_t i, pthread_t owner, pthread_t fail_state )
+{
+	PGconn *conn;
+	
+	/* the database went away, don't hammer it */
+	if( now_ms( ) < pool->retry_at ) {
+		pool->avail[i] = fail_state;
+		return -EAGAIN;
+	}
+	
+	(void)pthread_mutex_unlock( &pool->lock );
+	conn = open_conn( pool->conninfo );
+	(void)pthread_mutex_lock( &pool->lock );
+	
+	if( conn == NULL ) {
+		pool->avail[i] = fail_state;
+		pool->retry_at = now_ms( ) + pool->retry_delay;
+		pool->retry_delay *= 2;
+		if( pool->retry_delay > POOL_RETRY_DELAY_MAX * 1000 ) {
+			pool->retry_delay = POOL_RETRY_DELAY_MAX * 1000;
+		}
+		return -EIO;
+	}
+	
+	pool->retry_at = 0;
+	pool->retry_delay = POOL_RETRY_DELAY_MIN * 1000;
+	
+	pool->conns[i] = conn;
+	pool->idle_since[i] = now_ms( );
+	__atomic_store_n( &pool->avail[i], owner, __ATOMIC_SEQ_CST );
+	
+	return 0;
+}
+
+/* connections open or being opened */
+static size_t nof_open( PgConnPool *pool, int connecting )
+{
+	size_t i;
+	size_t n = 0;
+	
+	for( i = 0; i < pool->size; i++ ) {
+		if( is_open( pool->avail[i] ) ) n++;
+		else if( connecting && pool->avail[i] == (pthread_t)CONNECTING ) n++;
+	}
+	
+	return n;
+}
+
+/* closes idle connections above the minimum and reopens broken ones */
+static void *maintenance_main( void *arg )
+{
+	PgConnPool *pool = (PgConnPool *)arg;
+	struct timespec t;
+	size_t i;
+	size_t n;
+	uint64_t now;
+	
+	(void)pthread_mutex_lock( &pool->lock );
+	
+	while( !pool->stop ) {
+		(void)clock_gettime( CLOCK_REALTIME, &t );
+		t.tv_sec += POOL_MAINTENANCE_INTERVAL;
+		(void)pthread_cond_timedwait( &pool->stop_cond, &pool->lock, &t );
+		if( pool->stop ) break;
+		
+		now = now_ms( );
+		n = nof_open( pool, 0 );
+		
+		for( i = 0; i < pool->size && !pool->stop; i++ ) {
+			if( pool->avail[i] == (pthread_t)AVAILABLE && n > pool->min &&
+				now - pool->idle_since[i] >= POOL_IDLE_TIMEOUT * 1000 &&
+				__sync_bool_compare_and_swap( &pool->avail[i], (pthread_t)AVAILABLE, (pthread_t)CONNECTING ) ) {
+				PQfinish( pool->conns[i] );
+				pool->conns[i] = NULL;
+				pool->avail[i] = UNUSED;
+				n--;
+			} else if( pool->avail[i] == (pthread_t)ERROR ) {
+				if( pool->conns[i] != NULL ) {
+					PQfinish( pool->conns[i] );
+					pool->conns[i] = NULL;
+				}
+				if( n < pool->min ) {
+					pool->avail[i] = CONNECTING;
+					if( connect_slot( pool, i, (pthread_t)AVAILABLE, (pthread_t)ERROR ) == 0 ) {
+						n++;
+						(void)pthread_cond_signal( &pool->cond );
+					}
+				} else {
+					/* opened again on demand */
+					pool->avail[i] = UNUSED;
+				}
+			}
+		}
+		
+		/* let waiters look at the new state, they give up if there
+		 * is no connection at all */
+		if( pool->waiting > 0 ) {
+			(void)pthread_cond_broadcast( &pool->cond );
+		}
+	}
+	
+	(void)pthread_mutex_unlock( &pool->lock );
+	
+	return NULL;
+}
+
+int psql_pool_init( PgConnPool *pool, const char *conninfo, const size_t min_connections, const size_t max_connections )
 {
 	size_t i;
 	int res;
 	
+	pool->conninfo = strdup( conninfo );
+	if( pool->conninfo == NULL ) {
+		return -ENOMEM;
+	}
+	
 	pool->conns = (PGconn **)malloc( sizeof( PGconn * ) * max_connections );
 	if( pool->conns == NULL ) {
+		free( pool->conninfo );
 		return -ENOMEM;
 	}
 	
 	pool->avail = (pthread_t *)malloc( sizeof( pthread_t ) * max_connections );
 	if( pool->avail == NULL ) {
 		free( pool->conns );
+		free( pool->conninfo );
+		return -ENOMEM;
+	}
+	
+	pool->idle_since = (uint64_t *)malloc( sizeof( uint64_t ) * max_connections );
+	if( pool->idle_since == NULL ) {
+		free( pool->avail );
+		free( pool->conns );
+		free( pool->conninfo );
 		return -ENOMEM;
 	}
 	
 	pool->size = max_connections;
+	pool->min = ( min_connections < max_connections ) ? min_connections : max_connections;
+	pool->stop = 0;
+	pool->waiting = 0;
+	pool->retry_at = 0;
+	pool->retry_delay = POOL_RETRY_DELAY_MIN * 1000;
+	pool->acquires = 0;
+	pool->waits = 0;
+	pool->wait_us = 0;
+	pool->max_wait_us = 0;
 
 	res = pthread_mutex_init( &pool->lock, NULL );
-	if( res < 0 ) {
+	if( res != 0 ) {
+		free( pool->idle_since );
 		free( pool->avail );
 		free( pool->conns );
-		return res;
+		free( pool->conninfo );
+		return -res;
 	}
 	
 	res = pthread_cond_init( &pool->cond, NULL );
-	if( res < 0 ) {
+	if( res != 0 ) {
+		(void)pthread_mutex_destroy( &pool->lock );
+		free( pool->idle_since );
+		free( pool->avail );
+		free( pool->conns );
+		free( pool->conninfo );
+		return -res;
+	}
+	
+	res = pthread_cond_init( &pool->stop_cond, NULL );
+	if( res != 0 ) {
+		(void)pthread_cond_destroy( &pool->cond );
+		(void)pthread_mutex_destroy( &pool->lock );
+		free( pool->idle_since );
+		free( pool->avail );
+		free( pool->conns );
+		free( pool->conninfo );
+		return -res;
+	}
+	
+	res = pthread_key_create( &pool->slot_key, NULL );
+	if( res != 0 ) {
+		(void)pthread_cond_destroy( &pool->stop_cond );
+		(void)pthread_cond_destroy( &pool->cond );
 		(void)pthread_mutex_destroy( &pool->lock );
+		free( pool->idle_since );
 		free( pool->avail );
 		free( pool->conns );
-		return res;
+		free( pool->conninfo );
+		return -res;
 	}
 
 	for( i = 0; i < max_connections; i++ ) {
-		pool->conns[i] = PQconnectdb( conninfo );
-		if( PQstatus( pool->conns[i] ) == CONNECTION_OK ) {
-			pool->avail[i] = AVAILABLE;
-		} else {
-			syslog( LOG_ERR, "Connection to database failed: %s",
-				PQerrorMessage( pool->conns[i]) );
-			PQfinish( pool->conns[i] );
-			pool->avail[i] = ERROR;
+		pool->conns[i] = NULL;
+		pool->avail[i] = UNUSED;
+		pool->idle_since[i] = now_ms( );
+	}
+	
+	for( i = 0; i < pool->min; i++ ) {
+		pool->conns[i] = open_conn( conninfo );
+		pool->avail[i] = ( pool->conns[i] != NULL ) ? AVAILABLE : ERROR;
+	}
+	
+	res = pthread_create( &pool->thread, NULL, maintenance_main, pool );
+	if( res != 0 ) {
+		for( i = 0; i < pool->min; i++ ) {
+			if( pool->conns[i] != NULL ) PQfinish( pool->conns[i] );
 		}
+		(void)pthread_key_delete( pool->slot_key );
+		(void)pthread_cond_destroy( &pool->stop_cond );
+		(void)pthread_cond_destroy( &pool->cond );
+		(void)pthread_mutex_destroy( &pool->lock );
+		free( pool->idle_since );
+		free( pool->avail );
+		free( pool->conns );
+		free( pool->conninfo );
+		return -res;
 	}
 		
 	return 0;
@@ -79,64 +296,148 @@ int psql_pool_destroy( PgConnPool *pool )
 	int res1;
 	int res2;
 	
+	(void)pthread_mutex_lock( &pool->lock );
+	pool->stop = 1;
+	(void)pthread_cond_signal( &pool->stop_cond );
+	(void)pthread_mutex_unlock( &pool->lock );
+	(void)pthread_join( pool->thread, NULL );
+	
 	for( i = 0; i < pool->size; i++ ) {
-		if( pool->avail[i] == AVAILABLE ) {
+		if( pool->avail[i] == (pthread_t)AVAILABLE ) {
 			PQfinish( pool->conns[i] );
-		} else if( pool->avail[i] > 0 ) {
+		} else if( is_open( pool->avail[i] ) ) {
 			syslog( LOG_ERR, "Destroying pool connection to thread '%u' which is still in use",
 				(unsigned int)pool->avail[i] );
 			PQfinish( pool->conns[i] );
+		} else if( pool->conns[i] != NULL ) {
+			PQfinish( pool->conns[i] );
 		}
 	}
 	
 	free( pool->conns );
 	free( pool->avail );
+	free( pool->idle_since );
+	free( pool->conninfo );
 	
+	(void)pthread_key_delete( pool->slot_key );
+	(void)pthread_cond_destroy( &pool->stop_cond );
 	res1 = pthread_cond_destroy( &pool->cond );
 	res2 = pthread_mutex_destroy( &pool->lock );
 	
 	return ( res1 < 0 ) ? res1 : res2;
 }
 
+/* tries to take the free slot 'i', also without holding the lock */
+static int take_slot( PgConnPool *pool, size_t i )
+{
+	return __sync_bool_compare_and_swap( &pool->avail[i], (pthread_t)AVAILABLE, pthread_self( ) );
+}
+
+static uint64_t now_us( void )
+{
+	struct timespec t;
+
+	if( clock_gettime( CLOCK_MONOTONIC, &t ) != 0 ) {
+		return 0;
+	}
+
+	return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+static void count_wait( PgConnPool *pool, uint64_t start )
+{
+	uint64_t waited = now_us( ) - start;
+	
+	pool->waits++;
+	pool->wait_us += waited;
+	if( waited > pool->max_wait_us ) {
+		pool->max_wait_us = waited;
+	}
+}
+
 PGconn *psql_pool_acquire( PgConnPool *pool )
 {
 	int res;
 	size_t i;
+	size_t hint;
+	size_t unused;
+	uint64_t start;
+	
+	(void)__sync_fetch_and_add( &pool->acquires, 1 );
+	
+	/* fast path: a thread gets the connection it used last time if
+	 * it is free, without taking the lock */
+	hint = (size_t)pthread_getspecific( pool->slot_key );
+	if( hint > 0 && hint <= pool->size && take_slot( pool, hint - 1 ) ) {
+		if( PQstatus( pool->conns[hint - 1] ) == CONNECTION_OK ) {
+			return pool->conns[hint - 1];
+		}
+		pool->avail[hint - 1] = ERROR;
+	}
 
+	res = pthread_mutex_lock( &pool->lock );
+	if( res != 0 ) {
+		syslog( LOG_ERR, "Locking mutex failed for thread '%u': %d",
+			(unsigned int)pthread_self( ), res );
+		return NULL;
+	}
+	
+	start = now_us( );
+	
+	/* announce us before scanning, so a release seeing no waiters has
+	 * freed its slot before our scan */
+	(void)__sync_fetch_and_add( &pool->waiting, 1 );
+	
 	for( ;; ) {
-		res = pthread_mutex_lock( &pool->lock );
-		if( res < 0 ) {
-			syslog( LOG_ERR, "Locking mutex failed for thread '%u': %d",
-				(unsigned int)pthread_self( ), res );
-			return NULL;
-		}
-		
 		/* find a free connection, remember pid */
+		unused = pool->size;
 		for( i = 0; i < pool->size; i++ ) {
-			if( pool->avail[i] == AVAILABLE ) {
+			if( take_slot( pool, i ) ) {
 				if( PQstatus( pool->conns[i] ) == CONNECTION_OK ) {
-					pool->avail[i] = pthread_self( );
-					(void)pthread_mutex_unlock( &pool->lock );
-					return pool->conns[i];
+					break;
 				} else {
 					pool->avail[i] = ERROR;
 				}
+			} else if( pool->avail[i] == (pthread_t)UNUSED && unused == pool->size ) {
+				unused = i;
 			}
 		}
 		
+		/* all connections in use, grow the pool */
+		if( i == pool->size && unused < pool->size ) {
+			pool->avail[unused] = CONNECTING;
+			if( connect_slot( pool, unused, pthread_self( ), (pthread_t)UNUSED ) == 0 ) {
+				i = unused;
+			}
+		}
+		
+		/* the database is not reachable, there is no connection to
+		 * wait for */
+		if( i == pool->size && nof_open( pool, 1 ) == 0 ) {
+			(void)__sync_fetch_and_sub( &pool->waiting, 1 );
+			(void)pthread_mutex_unlock( &pool->lock );
+			return NULL;
+		}
+		
+		if( i < pool->size ) {
+			(void)__sync_fetch_and_sub( &pool->waiting, 1 );
+			count_wait( pool, start );
+			(void)pthread_mutex_unlock( &pool->lock );
+			(void)pthread_setspecific( pool->slot_key, (void *)( i + 1 ) );
+			return pool->conns[i];
+		}
+		
 		/* wait on conditional till a free connection is signalled */
 		res = pthread_cond_wait( &pool->cond, &pool->lock );
-		if( res < 0 ) {
+		if( res != 0 ) {
 			syslog( LOG_ERR, "Error waiting for free condition in thread '%u': %d",
 				(unsigned int)pthread_self( ), res );
+			(void)__sync_fetch_and_sub( &pool->waiting, 1 );
 			(void)pthread_mutex_unlock( &pool->lock );
 			return NULL;
 		}
-		
-		(void)pthread_mutex_unlock( &pool->lock );
 	}
 	
-	
 	return NULL;
 }
 
@@ -144,25 +445,52 @@ int psql_pool_release( PgConnPool *pool, PGconn *conn )
 {
 	int res;
 	int i;
+	size_t hint;
 
-	res = pthread_mutex_lock( &pool->lock );
-	if( res < 0 ) return res;
-	
-	for( i = pool->size-1; i >= 0; i-- ) {
-		if( pool->conns[i] == conn ) {
-			break;
+	hint = (size_t)pthread_getspecific( pool->slot_key );
+	if( hint > 0 && hint <= pool->size && pool->conns[hint - 1] == conn &&
+		pool->avail[hint - 1] == pthread_self( ) ) {
+		i = hint - 1;
+	} else {
+		res = pthread_mutex_lock( &pool->lock );
+		if( res != 0 ) return -res;
+		
+		for( i = pool->size-1; i >= 0; i-- ) {
+			if( pool->conns[i] == conn && is_open( pool->avail[i] ) ) {
+				break;
+			}
 		}
-	}
-	
-	if( i < 0 ) {
+		
 		(void)pthread_mutex_unlock( &pool->lock );
-		return -EINVAL;
+		
+		if( i < 0 ) {
+			return -EINVAL;
+		}
+		
+		(void)pthread_setspecific( pool->slot_key, (void *)( (size_t)i + 1 ) );
 	}
 
-	pool->avail[i] = AVAILABLE;
+	__atomic_store_n( &pool->idle_since[i], now_ms( ), __ATOMIC_RELAXED );
 	
-	(void)pthread_mutex_unlock( &pool->lock );
-	(void)pthread_cond_signal( &pool->cond );
+	/* a lost connection is replaced by the maintenance thread */
+	__atomic_store_n( &pool->avail[i], ( PQstatus( conn ) == CONNECTION_OK ) ? (pthread_t)AVAILABLE : (pthread_t)ERROR, __ATOMIC_SEQ_CST );
+	
+	/* only bother the lock if somebody waits for the connection */
+	if( __atomic_load_n( &pool->waiting, __ATOMIC_SEQ_CST ) > 0 ) {
+		(void)pthread_mutex_lock( &pool->lock );
+		(void)pthread_cond_signal( &pool->cond );
+		(void)pthread_mutex_unlock( &pool->lock );
+	}
 	
 	return 0;	
 }
+
+void psql_pool_stats( PgConnPool *pool, uint64_t *acquires, uint64_t *waits, uint64_t *wait_us, uint64_t *max_wait_us )
+{
+	(void)pthread_mutex_lock( &pool->lock );
+	*acquires = __atomic_load_n( &pool->acquires, __ATOMIC_RELAXED );
+	*waits = pool->waits;
+	*wait_us = pool->wait_us;
+	*max_wait_us = pool->max_wait_us;
+	(void)pthread_mutex_unlock( &pool->lock );
+}
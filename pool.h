@@ -19,20 +19,38 @@
 #define POOL_H
 
 #include <sys/types.h>		/* size_t */
+#include <stdint.h>		/* for uint64_t */
 
 #include <libpq-fe.h>		/* for Postgresql database access */
 
 #include <pthread.h>		/* for mutex and conditionals */
 
+/* the pool opens 'min' connections at start and grows up to 'size'
+ * connections when all are in use, a maintenance thread closes idle
+ * connections above 'min' and reopens broken ones */
 typedef struct PgConnPool {
+	char *conninfo;		/* connection info as used in PQconnectdb */
 	PGconn **conns;		/* array of connections */
 	size_t size;		/* max number of connections */
+	size_t min;		/* number of connections kept open */
 	pthread_t *avail;	/* slots of allocated/available connections per thread */
+	uint64_t *idle_since;	/* monotonic time in ms a connection got available */
 	pthread_mutex_t lock;	/* monitor lock */
 	pthread_cond_t cond;	/* condition signalling a free connection */
+	pthread_t thread;	/* the maintenance thread */
+	pthread_cond_t stop_cond; /* condition signalling the stop of the maintenance */
+	int stop;		/* the maintenance thread should terminate */
+	pthread_key_t slot_key;	/* slot (+1) of the connection a thread used last */
+	int waiting;		/* number of threads waiting for a connection */
+	uint64_t retry_at;	/* monotonic time in ms before which no connection is opened */
+	uint64_t retry_delay;	/* ms to wait after the next failed connect, doubles up to a limit */
+	uint64_t acquires;	/* number of acquired connections */
+	uint64_t waits;		/* acquires not served by the connection of the last use */
+	uint64_t wait_us;	/* total time in us spent in those acquires */
+	uint64_t max_wait_us;	/* longest time in us spent in one acquire */
 } PgConnPool;
 
-int psql_pool_init( PgConnPool *pool, const char *conninfo, const size_t max_connections );
+int psql_pool_init( PgConnPool *pool, const char *conninfo, const size_t min_connections, const size_t max_connections );
 
 int psql_pool_destroy( PgConnPool *pool );
 
@@ -40,4 +58,6 @@ PGconn *psql_pool_acquire( PgConnPool *pool );
 
 int psql_pool_release( PgConnPool *pool, PGconn *conn );
 
+void psql_pool_stats( PgConnPool *pool, uint64_t *acquires, uint64_t *waits, uint64_t *wait_us, uint64_t *max_wait_us );
+
 #endif
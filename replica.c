@@ -0,0 +1,241 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "replica.h"
+#include "pgsql.h"
+
+#include <string.h>		/* for strdup, strchr */
+#include <errno.h>		/* for ENOENT and friends */
+#include <stdlib.h>		/* for free, strtoull */
+#include <syslog.h>		/* for syslog */
+#include <time.h>		/* for clock_gettime */
+
+static uint64_t now_ms( void )
+{
+	struct timespec t;
+
+	if( clock_gettime( CLOCK_MONOTONIC, &t ) != 0 ) {
+		return 0;
+	}
+
+	return (uint64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+/* WAL position of a query returning a pg_lsn as text ('X/Y'), returns
+ * 0 if the query fails or returns NULL */
+static uint64_t query_lsn( PGconn *conn, const char *sql )
+{
+	PGresult *res;
+	const char *s;
+	char *slash;
+	uint64_t lsn;
+	
+	res = PQexec( conn, sql );
+	if( PQresultStatus( res ) != PGRES_TUPLES_OK || PQntuples( res ) != 1 || PQgetisnull( res, 0, 0 ) ) {
+		PQclear( res );
+		return 0;
+	}
+	
+	s = PQgetvalue( res, 0, 0 );
+	lsn = strtoull( s, &slash, 16 ) << 32;
+	if( *slash == '/' ) {
+		lsn |= strtoull( slash + 1, NULL, 16 );
+	}
+	
+	PQclear( res );
+	
+	return lsn;
+}
+
+static PGconn *check_conn( PGconn *conn )
+{
+	if( PQstatus( conn ) != CONNECTION_OK ) {
+		PQreset( conn );
+	}
+	
+	return ( PQstatus( conn ) == CONNECTION_OK ) ? conn : NULL;
+}
+
+/* one comparison of the standby with the primary */
+static void poll_lsn( PgReplica *replica )
+{
+	uint64_t seq;
+	uint64_t primary_lsn;
+	uint64_t standby_lsn;
+	
+	if( check_conn( replica->primary ) == NULL || check_conn( replica->standby ) == NULL ) {
+		return;
+	}
+	
+	/* the commits counted here are contained in the position of the
+	 * primary read afterwards */
+	seq = psql_write_seq( );
+	
+	primary_lsn = query_lsn( replica->primary, ( PQserverVersion( replica->primary ) >= 100000 ) ?
+		"SELECT pg_current_wal_lsn( )" : "SELECT pg_current_xlog_location( )" );
+	standby_lsn = query_lsn( replica->standby, ( PQserverVersion( replica->standby ) >= 100000 ) ?
+		"SELECT pg_last_wal_replay_lsn( )" : "SELECT pg_last_xlog_replay_location( )" );
+	
+	/* not a standby or an error */
+	if( primary_lsn == 0 || standby_lsn == 0 ) {
+		return;
+	}
+	
+	(void)pthread_mutex_lock( &replica->lock );
+	replica->lag = ( primary_lsn > standby_lsn ) ? primary_lsn - standby_lsn : 0;
+	replica->polled_at = now_ms( );
+	replica->standby_lsn = standby_lsn;
+	
+	/* only a new commit of this mount moves the position the standby has
+	 * to reach, the writes of others don't keep us off the standby */
+	if( seq != replica->commit_seq ) {
+		replica->commit_seq = seq;
+		replica->commit_lsn = primary_lsn;
+	}
+	(void)pthread_mutex_unlock( &replica->lock );
+}
+
+static void *poller_main( void *arg )
+{
+	PgReplica *replica = (PgReplica *)arg;
+	struct timespec t;
+	
+	(void)pthread_mutex_lock( &replica->lock );
+	
+	while( !replica->stop ) {
+		(void)pthread_mutex_unlock( &replica->lock );
+		poll_lsn( replica );
+		(void)pthread_mutex_lock( &replica->lock );
+		
+		(void)clock_gettime( CLOCK_REALTIME, &t );
+		t.tv_sec += (time_t)replica->interval;
+		t.tv_nsec += (long)( ( replica->interval - (time_t)replica->interval ) * 1000000000 );
+		if( t.tv_nsec >= 1000000000 ) {
+			t.tv_sec++;
+			t.tv_nsec -= 1000000000;
+		}
+		
+		if( !replica->stop ) {
+			(void)pthread_cond_timedwait( &replica->cond, &replica->lock, &t );
+		}
+	}
+	
+	(void)pthread_mutex_unlock( &replica->lock );
+	
+	return NULL;
+}
+
+int psql_replica_start( PgReplica *replica, const char *primary_conninfo, const char *standby_conninfo,
+	const size_t min_connections, const size_t max_connections, const double interval, const uint64_t max_lag )
+{
+	int res;
+	
+	replica->interval = interval;
+	replica->max_lag = max_lag;
+	replica->lag = 0;
+	replica->polled_at = 0;
+	replica->commit_seq = 0;
+	replica->commit_lsn = 0;
+	replica->standby_lsn = 0;
+	replica->stop = 0;
+	
+	/* the poller connections may fail now, they are reset later */
+	replica->primary = PQconnectdb( primary_conninfo );
+	replica->standby = PQconnectdb( standby_conninfo );
+	if( PQstatus( replica->standby ) != CONNECTION_OK ) {
+		syslog( LOG_ERR, "Connection to replica failed: %s",
+			PQerrorMessage( replica->standby ) );
+	}
+	
+	res = psql_pool_init( &replica->pool, standby_conninfo, min_connections, max_connections );
+	if( res < 0 ) {
+		PQfinish( replica->standby );
+		PQfinish( replica->primary );
+		return res;
+	}
+	
+	res = pthread_mutex_init( &replica->lock, NULL );
+	if( res != 0 ) {
+		(void)psql_pool_destroy( &replica->pool );
+		PQfinish( replica->standby );
+		PQfinish( replica->primary );
+		return -res;
+	}
+	
+	res = pthread_cond_init( &replica->cond, NULL );
+	if( res != 0 ) {
+		(void)pthread_mutex_destroy( &replica->lock );
+		(void)psql_pool_destroy( &replica->pool );
+		PQfinish( replica->standby );
+		PQfinish( replica->primary );
+		return -res;
+	}
+	
+	res = pthread_create( &replica->thread, NULL, poller_main, replica );
+	if( res != 0 ) {
+		(void)pthread_cond_destroy( &replica->cond );
+		(void)pthread_mutex_destroy( &replica->lock );
+		(void)psql_pool_destroy( &replica->pool );
+		PQfinish( replica->standby );
+		PQfinish( replica->primary );
+		return -res;
+	}
+	
+	return 0;
+}
+
+int psql_replica_stop( PgReplica *replica )
+{
+	(void)pthread_mutex_lock( &replica->lock );
+	replica->stop = 1;
+	(void)pthread_cond_signal( &replica->cond );
+	(void)pthread_mutex_unlock( &replica->lock );
+	
+	(void)pthread_join( replica->thread, NULL );
+	
+	PQfinish( replica->standby );
+	PQfinish( replica->primary );
+	
+	(void)pthread_cond_destroy( &replica->cond );
+	(void)pthread_mutex_destroy( &replica->lock );
+	
+	return psql_pool_destroy( &replica->pool );
+}
+
+PGconn *psql_replica_acquire( PgReplica *replica )
+{
+	int usable;
+	
+	(void)pthread_mutex_lock( &replica->lock );
+	usable = replica->polled_at > 0 &&
+		now_ms( ) - replica->polled_at <= (uint64_t)( 3 * replica->interval * 1000 ) + 1000 &&
+		replica->lag <= replica->max_lag &&
+		replica->commit_seq >= psql_write_seq( ) &&
+		replica->standby_lsn >= replica->commit_lsn;
+	(void)pthread_mutex_unlock( &replica->lock );
+	
+	if( !usable ) {
+		return NULL;
+	}
+	
+	return psql_pool_acquire( &replica->pool );
+}
+
+int psql_replica_release( PgReplica *replica, PGconn *conn )
+{
+	return psql_pool_release( &replica->pool, conn );
+}
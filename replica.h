@@ -0,0 +1,60 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef REPLICA_H
+#define REPLICA_H
+
+#include <stdint.h>		/* for uint64_t */
+
+#include <libpq-fe.h>		/* for Postgresql database access */
+
+#include <pthread.h>		/* for threads, mutex and conditionals */
+
+#include "pool.h"		/* for PgConnPool */
+
+/* a hot standby serving reads, a poller compares its replay position
+ * with the WAL position of the primary after the latest commit of this
+ * mount */
+typedef struct PgReplica {
+	PgConnPool pool;	/* connections to the standby */
+	PGconn *primary;	/* connection of the poller to the primary */
+	PGconn *standby;	/* connection of the poller to the standby */
+	double interval;	/* seconds between two polls */
+	uint64_t max_lag;	/* bytes of WAL the standby may lag behind */
+	uint64_t lag;		/* lag in bytes at the last poll */
+	uint64_t polled_at;	/* monotonic time in ms of the last successful poll */
+	uint64_t commit_seq;	/* psql_write_seq( ) when 'commit_lsn' was read */
+	uint64_t commit_lsn;	/* WAL position of the primary containing the commits up to 'commit_seq' */
+	uint64_t standby_lsn;	/* replay position of the standby at the last poll */
+	pthread_t thread;	/* the poller thread */
+	pthread_mutex_t lock;	/* monitor lock */
+	pthread_cond_t cond;	/* condition signalling the stop */
+	int stop;		/* the poller should terminate */
+} PgReplica;
+
+int psql_replica_start( PgReplica *replica, const char *primary_conninfo, const char *standby_conninfo,
+	const size_t min_connections, const size_t max_connections, const double interval, const uint64_t max_lag );
+
+int psql_replica_stop( PgReplica *replica );
+
+/* a connection to the standby if it is recent enough and has all our
+ * own committed writes, NULL otherwise */
+PGconn *psql_replica_acquire( PgReplica *replica );
+
+int psql_replica_release( PgReplica *replica, PGconn *conn );
+
+#endif
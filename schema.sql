@@ -40,6 +40,49 @@ CREATE OR REPLACE RULE "dir_remove" AS ON
 	DELETE TO dir WHERE OLD.mode & 16384 = 0
 	DO ALSO DELETE FROM data WHERE dir_id=OLD.id;	
 	
+-- tell other mounts about changes, so they can drop their cached
+-- copies: 'd <client> <id> <parent_id> <name>' for entries and
+-- 'b <client> <dir_id>' for the data of a file, <client> is the
+-- pgfuse.client setting of the changing mount
+CREATE OR REPLACE FUNCTION pgfuse_notify_dir( ) RETURNS TRIGGER AS $$
+DECLARE
+	client TEXT := COALESCE( current_setting( 'pgfuse.client', true ), '-' );
+BEGIN
+	IF TG_OP <> 'INSERT' THEN
+		PERFORM pg_notify( 'pgfuse', 'd ' || client || ' ' || OLD.id || ' ' || OLD.parent_id || ' ' || COALESCE( OLD.name, '' ) );
+	END IF;
+	IF TG_OP <> 'DELETE' THEN
+		PERFORM pg_notify( 'pgfuse', 'd ' || client || ' ' || NEW.id || ' ' || NEW.parent_id || ' ' || COALESCE( NEW.name, '' ) );
+	END IF;
+	RETURN NULL;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION pgfuse_notify_data( ) RETURNS TRIGGER AS $$
+DECLARE
+	client TEXT := COALESCE( current_setting( 'pgfuse.client', true ), '-' );
+BEGIN
+	IF TG_OP = 'DELETE' THEN
+		PERFORM pg_notify( 'pgfuse', 'b ' || client || ' ' || OLD.dir_id );
+	ELSE
+		PERFORM pg_notify( 'pgfuse', 'b ' || client || ' ' || NEW.dir_id );
+	END IF;
+	RETURN NULL;
+END;
+$$ LANGUAGE plpgsql;
+
+-- the same payload is sent only once per transaction, so a file
+-- written in many blocks results in one notification. The triggers
+-- cost a PL/pgSQL call and a pg_notify for every changed row, also if
+-- all mounts run with '-o nonotify'. Single mounts can do without:
+--   DROP TRIGGER dir_notify ON dir;
+--   DROP TRIGGER data_notify ON data;
+CREATE TRIGGER dir_notify AFTER INSERT OR UPDATE OR DELETE ON dir
+	FOR EACH ROW EXECUTE PROCEDURE pgfuse_notify_dir( );
+
+CREATE TRIGGER data_notify AFTER INSERT OR UPDATE OR DELETE ON data
+	FOR EACH ROW EXECUTE PROCEDURE pgfuse_notify_data( );
+
 -- self-referencing anchor for root directory
 -- 16895 = S_IFDIR and 0777 permissions, belonging to root/root
 -- TODO: should be done from outside, see note above
@@ -0,0 +1,35 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STATEMENTS_H
+#define STATEMENTS_H
+
+/* SQL of the prepared statements on the hot metadata paths, shared with
+ * tests/benchprepared.c, parameter types are given by casts */
+
+/* resolves the names $1 (text array) below directory $3, at most $2
+ * levels deep, one row per level reached */
+#define WALK_PATH_SQL "WITH RECURSIVE walk( depth, id, size, mode, uid, gid, ctime, mtime, atime, parent_id ) AS ( " \
+	"SELECT 0, id, size, mode, uid, gid, ctime, mtime, atime, parent_id FROM dir WHERE id = $3::bigint " \
+	"UNION ALL " \
+	"SELECT w.depth + 1, d.id, d.size, d.mode, d.uid, d.gid, d.ctime, d.mtime, d.atime, d.parent_id FROM walk w, dir d " \
+	"WHERE w.depth < $2::integer AND w.mode & 61440 = 16384 AND d.parent_id = w.id AND d.name = ($1::text[])[w.depth + 1] ) " \
+	"SELECT depth, id, size, mode, uid, gid, ctime, mtime, atime, parent_id FROM walk ORDER BY depth ASC"
+
+#define READ_META_SQL "SELECT size, mode, uid, gid, ctime, mtime, atime, parent_id FROM dir WHERE id = $1::bigint"
+
+#endif
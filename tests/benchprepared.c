@@ -0,0 +1,283 @@
+/*
+    Copyright (C) 2012 Andreas Baumann <abaumann@yahoo.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* compares the latency of the metadata queries of pgfuse when sent
+ * as parameterized SQL (parsed and planned on every call) and as
+ * prepared statements (parsed and planned once per connection)
+ *
+ * the path walked is a chain of directories created in a transaction
+ * which is rolled back at the end, both variants are warmed up and run
+ * interleaved in rounds, so neither one pays for a cold cache alone
+ */
+
+#include <libpq-fe.h>		/* for Postgresql database access */
+
+#include <stdio.h>		/* for fprintf */
+#include <stdlib.h>		/* for atoi */
+#include <stdint.h>		/* for uint64_t */
+#include <arpa/inet.h>		/* for htonl */
+#include <sys/time.h>		/* for gettimeofday */
+#include <unistd.h>		/* for gethostname, getpid */
+#include <string.h>		/* for strlen */
+
+#include "endian.h"		/* for htobe64 */
+#include "statements.h"		/* for the SQL of pgfuse */
+
+#define DEFAULT_ITERATIONS 10000
+
+/* number of directories in the path walked */
+#define PATH_DEPTH 4
+
+/* the variants alternate this many times */
+#define ROUNDS 10
+
+static double now_us( void )
+{
+	struct timeval t;
+
+	gettimeofday( &t, NULL );
+
+	return (double)t.tv_sec * 1000000.0 + t.tv_usec;
+}
+
+/* runs the statement 'iterations' times, either prepared (name given)
+ * or as parameterized SQL, returns the time of all calls in us
+ */
+static double bench( PGconn *conn, const char *name, const char *sql, int nof_params,
+                     const char **values, const int *lengths, const int *binary, int iterations )
+{
+	PGresult *res;
+	double start;
+	int i;
+
+	start = now_us( );
+
+	for( i = 0; i < iterations; i++ ) {
+		if( name != NULL ) {
+			res = PQexecPrepared( conn, name, nof_params, values, lengths, binary, 1 );
+		} else {
+			res = PQexecParams( conn, sql, nof_params, NULL, values, lengths, binary, 1 );
+		}
+		if( PQresultStatus( res ) != PGRES_TUPLES_OK ) {
+			fprintf( stderr, "query error: %s\n", PQerrorMessage( conn ) );
+			PQclear( res );
+			return -1.0;
+		}
+		PQclear( res );
+	}
+
+	return now_us( ) - start;
+}
+
+/* warms both variants up and runs them in alternating order, returns
+ * the average time per call in 'params_us' and 'prepared_us' */
+static int bench_both( PGconn *conn, const char *name, const char *sql, int nof_params,
+                       const char **values, const int *lengths, const int *binary, int iterations,
+                       double *params_us, double *prepared_us )
+{
+	int per_round = ( iterations + ROUNDS - 1 ) / ROUNDS;
+	double t1;
+	double t2;
+	int i;
+
+	if( bench( conn, NULL, sql, nof_params, values, lengths, binary, per_round ) < 0 ||
+	    bench( conn, name, NULL, nof_params, values, lengths, binary, per_round ) < 0 ) {
+		return -1;
+	}
+
+	*params_us = 0.0;
+	*prepared_us = 0.0;
+	for( i = 0; i < ROUNDS; i++ ) {
+		if( i % 2 == 0 ) {
+			t1 = bench( conn, NULL, sql, nof_params, values, lengths, binary, per_round );
+			t2 = bench( conn, name, NULL, nof_params, values, lengths, binary, per_round );
+		} else {
+			t2 = bench( conn, name, NULL, nof_params, values, lengths, binary, per_round );
+			t1 = bench( conn, NULL, sql, nof_params, values, lengths, binary, per_round );
+		}
+		if( t1 < 0 || t2 < 0 ) {
+			return -1;
+		}
+		*params_us += t1;
+		*prepared_us += t2;
+	}
+
+	*params_us /= (double)per_round * ROUNDS;
+	*prepared_us /= (double)per_round * ROUNDS;
+
+	return 0;
+}
+
+static int exec_command( PGconn *conn, const char *sql )
+{
+	PGresult *res;
+
+	res = PQexec( conn, sql );
+	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
+		fprintf( stderr, "'%s' failed: %s\n", sql, PQerrorMessage( conn ) );
+		PQclear( res );
+		return -1;
+	}
+	PQclear( res );
+
+	return 0;
+}
+
+/* creates PATH_DEPTH nested directories below the root directory,
+ * returns the id of the deepest one and the names as a text array */
+static int64_t create_path( PGconn *conn, char *array, size_t size )
+{
+	PGresult *res;
+	char name[32];
+	char parent[32];
+	const char *values[2];
+	int64_t id = 0;
+	size_t len;
+	int i;
+
+	snprintf( array, size, "{" );
+	for( i = 0; i < PATH_DEPTH; i++ ) {
+		snprintf( name, sizeof( name ), "benchprepared.%d.%d", (int)getpid( ), i );
+		snprintf( parent, sizeof( parent ), "%lld", (long long)id );
+		values[0] = parent;
+		values[1] = name;
+		res = PQexecParams( conn, "INSERT INTO dir( parent_id, name, mode, ctime, mtime, atime ) "
+			"VALUES ( $1::bigint, $2::text, 16877, now( ), now( ), now( ) ) RETURNING id",
+			2, NULL, values, NULL, NULL, 0 );
+		if( PQresultStatus( res ) != PGRES_TUPLES_OK || PQntuples( res ) != 1 ) {
+			fprintf( stderr, "creating directory '%s' failed: %s\n", name, PQerrorMessage( conn ) );
+			PQclear( res );
+			return -1;
+		}
+		id = atoll( PQgetvalue( res, 0, 0 ) );
+		PQclear( res );
+
+		len = strlen( array );
+		snprintf( array + len, size - len, "%s%s", ( i > 0 ) ? "," : "", name );
+	}
+	len = strlen( array );
+	snprintf( array + len, size - len, "}" );
+
+	return id;
+}
+
+static int prepare( PGconn *conn, const char *name, const char *sql, int nof_params )
+{
+	PGresult *res;
+
+	res = PQprepare( conn, name, sql, nof_params, NULL );
+	if( PQresultStatus( res ) != PGRES_COMMAND_OK ) {
+		fprintf( stderr, "prepare error: %s\n", PQerrorMessage( conn ) );
+		PQclear( res );
+		return -1;
+	}
+	PQclear( res );
+
+	return 0;
+}
+
+/* prints one row per statement in the layout of the table in BENCHMARKS */
+static int run( PGconn *conn, int iterations )
+{
+	int64_t deepest_id;
+	int64_t param_root = htobe64( 0 );
+	int64_t param_id;
+	const char *meta_values[1] = { (const char *)&param_id };
+	int meta_lengths[1] = { sizeof( param_id ) };
+	int meta_binary[1] = { 1 };
+	int param_depth = htonl( PATH_DEPTH );
+	char path[PATH_DEPTH * 32 + 3];
+	const char *walk_values[3] = { path, (const char *)&param_depth, (const char *)&param_root };
+	int walk_lengths[3] = { 0, sizeof( param_depth ), sizeof( param_root ) };
+	int walk_binary[3] = { 0, 1, 1 };
+	double params_us;
+	double prepared_us;
+	char machine[64];
+
+	deepest_id = create_path( conn, path, sizeof( path ) );
+	if( deepest_id < 0 ) {
+		return -1;
+	}
+	param_id = htobe64( deepest_id );
+	walk_lengths[0] = strlen( path );
+
+	if( gethostname( machine, sizeof( machine ) ) < 0 ) {
+		snprintf( machine, sizeof( machine ), "unknown" );
+	}
+	machine[sizeof( machine ) - 1] = '\0';
+	
+	printf( "Machine        Statement  Calls  Unprepared us  Prepared us   Gain\n" );
+
+	if( bench_both( conn, "read_meta", READ_META_SQL, 1, meta_values, meta_lengths, meta_binary, iterations,
+		&params_us, &prepared_us ) < 0 ) {
+		return -1;
+	}
+	printf( "%-14.14s read_meta %6d %14.1f %12.1f %5.1f%%\n",
+		machine, iterations, params_us, prepared_us, 100.0 * ( params_us - prepared_us ) / params_us );
+
+	if( bench_both( conn, "walk_path", WALK_PATH_SQL, 3, walk_values, walk_lengths, walk_binary, iterations,
+		&params_us, &prepared_us ) < 0 ) {
+		return -1;
+	}
+	printf( "%-14.14s walk_path %6d %14.1f %12.1f %5.1f%%\n",
+		machine, iterations, params_us, prepared_us, 100.0 * ( params_us - prepared_us ) / params_us );
+
+	return 0;
+}
+
+int main( int argc, char *argv[] )
+{
+	PGconn *conn;
+	int iterations = DEFAULT_ITERATIONS;
+	int res;
+
+	if( argc < 2 || argc > 3 ) {
+		fprintf( stderr, "usage: benchprepared <Pg conn info> [iterations]\n" );
+		return 1;
+	}
+	if( argc == 3 ) {
+		iterations = atoi( argv[2] );
+		if( iterations <= 0 ) iterations = DEFAULT_ITERATIONS;
+	}
+
+	conn = PQconnectdb( argv[1] );
+	if( PQstatus( conn ) != CONNECTION_OK ) {
+		fprintf( stderr, "Connection to database failed: %s",
+			PQerrorMessage( conn ) );
+		PQfinish( conn );
+		return 1;
+	}
+
+	if( prepare( conn, "read_meta", READ_META_SQL, 1 ) < 0 ||
+	    prepare( conn, "walk_path", WALK_PATH_SQL, 3 ) < 0 ) {
+		PQfinish( conn );
+		return 1;
+	}
+
+	/* the directories created are only visible in this transaction */
+	if( exec_command( conn, "BEGIN" ) < 0 ) {
+		PQfinish( conn );
+		return 1;
+	}
+
+	res = run( conn, iterations );
+
+	(void)exec_command( conn, "ROLLBACK" );
+	PQfinish( conn );
+
+	return ( res < 0 ) ? 1 : 0;
+}